@@ -1,5 +1,11 @@
 
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "mpc.h"
 #define LASSERT(args, cond, fmt, ...) \
   if (!(cond)) { \
@@ -12,15 +18,35 @@
   LASSERT(lval, lval->count == size, "Function %s passed too many arguments. Got %i, Expected %i", parameter, lval->count, size); \
 
 #define LASSERT_TYPE(parameter, lval, position, lvalType)			\
-  LASSERT(lval, lval->cell[position]->type == lvalType , "Function %s passed incorrect type!, Got %s, Expected %s.", parameter, ltype_name(lval->cell[position]->type), ltype_name(lvalType)); \
+  LASSERT(lval, lval_type(lval->cell[position]) == lvalType , "Function %s passed incorrect type!, Got %s, Expected %s.", parameter, ltype_name(lval_type(lval->cell[position])), ltype_name(lvalType)); \
+
+#define LASSERT_ALL_NUM(lval)						\
+  for (int i = 0; i < lval->count; i++) {				\
+    LASSERT(lval, lval_is_num(lval->cell[i]), "Cannot operate on non-number!"); \
+  }
+
+#define LASSERT_NUMBER(parameter, lval, position)			\
+  LASSERT(lval, lval_is_num(lval->cell[position]), "Function %s passed incorrect type!, Got %s, Expected %s.", parameter, ltype_name(lval_type(lval->cell[position])), ltype_name(LVAL_NUM)); \
 
 /* Declare a buffer for user input of size 2048 */
 
 static char input[2048];
 struct lval;
 struct lenv;
+struct lsym;
+struct lcode;
+struct lbig;
+struct lvec;
+struct lmap;
+struct lhnode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
+typedef struct lcode lcode;
+typedef struct lbig lbig;
+typedef struct lvec lvec;
+typedef struct lmap lmap;
+typedef struct lhnode lhnode;
 
  /* Create some parses */ 
 mpc_parser_t* Number;
@@ -35,42 +61,229 @@ mpc_parser_t* Galisp;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Values are reference counted and shared. Reading a binding, passing an
+   argument or returning a value hands out another reference with lval_ref
+   rather than copying. Anything that mutates a value in place must own it
+   first, see lval_own.
+
+   Only the fields of the value's type are stored, the variants overlap in
+   a union. Numbers that fit in a fixnum are not allocated at all, the lval
+   pointer itself carries the number shifted left with the low bit set
+   (real nodes are always aligned, so their low bit is clear). Always go
+   through lval_type and lval_to_long for anything that may be a number. */
 struct lval {
   int type;
+  int refs;
+
+  // collector bookkeeping
+  int gc_slot;
+  char gc_mark;
+
+  // compiled bytecode, only ever set on functions and expressions
+  lcode* code;
+
+  union {
+    // basic, num only holds numbers too big for a fixnum and big the
+    // ones too big for a long
+    long num;
+    lbig* big;
+    double dbl;
+    lvec* vec;
+    lmap* map;
+
+    // persistent map
+    struct {
+      lhnode* trie;
+      int trie_count;
+    };
+    lsym* sym;
+    char* err;
+
+    // strings know their length and cache their hash once it is asked
+    // for (0 until then). Concatenation builds a rope: 'str' stays NULL
+    // and the string is 'left' followed by 'right' until the characters
+    // are first needed, see lval_str_chars. Short strings and errors
+    // keep their text in 'small' and point 'str' or 'err' at it.
+    struct {
+      char* str;
+      union {
+        struct {
+          lval* left;
+          lval* right;
+        };
+        char small[16];
+      };
+      int len;
+      unsigned hash;
+    };
+
+    // functions. Scoping is dynamic, so a lambda closes over nothing,
+    // the only bindings it carries are the arguments a partial
+    // application supplied to its first formals: 'bound' holds them in
+    // order, or is NULL.
+    struct {
+      lbuiltin builtin;
+      lval* bound;
+      lval* formals;
+      lval* body;
+    };
+
+    // Expression, 'cell' points 'offset' slots into an array of
+    // 'capacity' so popping the front is just a step forward. A slice
+    // has a 'backing' expression owning the cells it views instead.
+    struct {
+      int count;
+      int capacity;
+      int offset;
+      struct lval** cell;
+      struct lval* backing;
+    };
+  };
+};
 
-  // basic
-  long num;
-  char* sym;
-  char* err;
-  char* str;
-  
-  // functions
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_IS_FIXNUM(v) ((uintptr_t)(v) & 1)
 
-  // Expression
-  int count;
-  struct lval** cell;
-};
+/* Bindings live in two parallel arrays grown geometrically. Small
+   environments (function calls) are scanned linearly, once an environment
+   passes LENV_HASH_MIN bindings an open addressing index is kept next to
+   the arrays, mapping a symbol hash to its position + 1 (0 means empty).
+   The top level environment needs neither, each symbol remembers its
+   slot there. */
+#define LENV_HASH_MIN 8
 
 struct lenv {
   lenv* parent;
+  int gc_slot;
+  char gc_mark;
+
   int count;
-  char** syms;
+  int capacity;
+  lsym** syms;
   lval** vals;
+
+  int* index;
+  int index_size;
+};
+
+/* An interned symbol name. There is exactly one lsym per distinct name,
+   so two symbols are the same if and only if their pointers are equal.
+   'locals' counts the live bindings of the symbol outside the top level
+   environment, while it is 0 only a global can be in scope. 'global' is
+   the slot of its binding in the top level environment, or -1. */
+struct lsym {
+  unsigned long hash;
+  lsym* next;
+  int locals;
+  int global;
+  char name[];
+};
+
+/* Call-site cache of a global binding, valid while the top level
+   environment is still at 'version'. The value is not referenced, the
+   binding keeps it alive until the version moves on. */
+typedef struct {
+  lval* value;
+  long version;
+} lcache;
+
+/* Compiled form of an expression. Ops are a flat array of ints, opcodes
+   followed by their operands, running on a value stack of at most
+   max_stack entries. Code is reference counted, a copy of a function or
+   an expression shares its code with the original. */
+struct lcode {
+  int refs;
+
+  int* ops;
+  int count;
+  int capacity;
+
+  lval** consts;
+  int const_count;
+  int const_capacity;
+
+  lcache* caches;
+  int cache_count;
+
+  int max_stack;
 };
 
+/* Intern table, chained buckets. Size is always a power of two */
+lsym** lsym_table = NULL;
+int lsym_table_size = 0;
+int lsym_count = 0;
+
+/* Symbol used to mark variadic formals, interned once in main */
+lsym* lsym_rest;
+
+unsigned long lsym_hash(char* s) {
+  /* FNV-1a */
+  unsigned long h = 2166136261u;
+  while(*s) {
+    h ^= (unsigned char) *s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void lsym_table_grow(void) {
+  int size = lsym_table_size ? lsym_table_size * 2 : 256;
+  lsym** table = calloc(size, sizeof(lsym*));
+
+  /* Rehash every chain into the new table */
+  for (int i = 0; i < lsym_table_size; i++) {
+    lsym* s = lsym_table[i];
+    while(s) {
+      lsym* next = s->next;
+      s->next = table[s->hash & (size-1)];
+      table[s->hash & (size-1)] = s;
+      s = next;
+    }
+  }
+
+  free(lsym_table);
+  lsym_table = table;
+  lsym_table_size = size;
+}
+
+lsym* lsym_intern(char* name) {
+  unsigned long hash = lsym_hash(name);
+
+  if(lsym_table) {
+    for (lsym* s = lsym_table[hash & (lsym_table_size-1)]; s; s = s->next) {
+      if(s->hash == hash && strcmp(s->name, name) == 0) { return s; }
+    }
+  }
+
+  /* Not seen before, keep load factor under 1 */
+  if(lsym_count >= lsym_table_size) { lsym_table_grow(); }
+
+  lsym* s = malloc(sizeof(lsym) + strlen(name) + 1);
+  s->hash = hash;
+  s->locals = 0;
+  s->global = -1;
+  strcpy(s->name, name);
+  s->next = lsym_table[hash & (lsym_table_size-1)];
+  lsym_table[hash & (lsym_table_size-1)] = s;
+  lsym_count++;
+  return s;
+}
+
 
 
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_STR };
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_STR, LVAL_BIG, LVAL_DBL, LVAL_VEC, LVAL_MAP, LVAL_HAMT };
 
 char* ltype_name(int t) {
   switch(t) {
   case LVAL_FUN: return "Function";
   case LVAL_NUM: return "Number";
+  case LVAL_BIG: return "Big Number";
+  case LVAL_DBL: return "Float";
+  case LVAL_VEC: return "Vector";
+  case LVAL_MAP: return "Map";
+  case LVAL_HAMT: return "Persistent Map";
   case LVAL_ERR: return "Error";
   case LVAL_SYM: return "Symbol";
   case LVAL_STR: return "String";
@@ -80,6 +293,15 @@ char* ltype_name(int t) {
   }
 }
 
+int lval_type(lval* v) {
+  return LVAL_IS_FIXNUM(v) ? LVAL_NUM : v->type;
+}
+
+long lval_to_long(lval* v) {
+  /* Shifting right keeps the sign */
+  return LVAL_IS_FIXNUM(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 
 lval* lval_take(lval* v, int i); 
 lval* lval_pop(lval* v, int i);
@@ -87,590 +309,3545 @@ lval* lval_eval(lenv* e, lval* v);
 lval* lval_read(mpc_ast_t* t);
 lval* lval_add(lval* v, lval* x);
 void lval_print(lval *v);
+void lval_print_dbl(double x);
+int lval_is_num(lval* v);
+int lval_num_cmp(lval* x, lval* y);
+lbig* lbig_new(int size);
+void lbig_print(lbig* b);
+lval* lval_read_big(char* s);
+void lvec_print(lvec* v);
+void lval_map_print(lval* m);
+void gc_mark_lval(lval* v);
 void lval_expr_print(lval *v, char open, char close);
 void lval_del(lval* v);
+void lval_free(lval* v);
 lval* lval_copy(lval* v);
+lval* lval_own(lval* v);
+char* lval_str_chars(lval* v);
+unsigned lval_str_hash(lval* v);
+int lval_str_eq(lval* x, lval* y);
+lenv* lenv_new(void);
 
 lval* lval_join(lval* x, lval* y);
 
-lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-  return v;
+/* Slab allocator.
+
+   lval and lenv nodes are carved out of slabs of POOL_SLAB objects of one
+   size, one pool per size class. Freed nodes go on the pool's free stack
+   and are handed out again before a new slab is allocated, so the churn of
+   temporaries during evaluation never reaches malloc. Each slab records
+   which of its slots are live, which is what the collector sweeps. */
+#define POOL_SLAB 256
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POOL_POISON(p, size) ASAN_POISON_MEMORY_REGION(p, size)
+#define POOL_UNPOISON(p, size) ASAN_UNPOISON_MEMORY_REGION(p, size)
+#else
+#define POOL_POISON(p, size)
+#define POOL_UNPOISON(p, size)
+#endif
+
+typedef struct {
+  char* objects;
+  char live[POOL_SLAB];
+} lslab;
+
+typedef struct {
+  size_t size;
+  lslab** slabs;
+  int slab_count;
+
+  int* free;
+  int free_count;
+
+  long live;
+} lpool;
+
+void lpool_grow(lpool* p) {
+  lslab* slab = malloc(sizeof(lslab));
+  slab->objects = malloc(p->size * POOL_SLAB);
+  memset(slab->live, 0, POOL_SLAB);
+  POOL_POISON(slab->objects, p->size * POOL_SLAB);
+
+  p->slabs = realloc(p->slabs, sizeof(lslab*) * (p->slab_count + 1));
+  p->slabs[p->slab_count++] = slab;
+
+  /* The free stack can hold every slot of every slab */
+  p->free = realloc(p->free, sizeof(int) * p->slab_count * POOL_SLAB);
+  for (int i = POOL_SLAB-1; i >= 0; i--) {
+    p->free[p->free_count++] = (p->slab_count-1) * POOL_SLAB + i;
+  }
 }
 
-lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+void* lpool_at(lpool* p, int slot) {
+  return p->slabs[slot / POOL_SLAB]->objects + (slot % POOL_SLAB) * p->size;
+}
 
-  // Create a variable list
-  va_list va;
-  va_start(va, fmt);
+/* Objects remember their slot number so they can be given back */
+void* lpool_alloc(lpool* p, int* slot) {
+  if(p->free_count == 0) { lpool_grow(p); }
+  *slot = p->free[--p->free_count];
+  p->slabs[*slot / POOL_SLAB]->live[*slot % POOL_SLAB] = 1;
+  p->live++;
 
-  // Allocate 512 bytes of memory
-  v->err = malloc(512);
+  void* o = lpool_at(p, *slot);
+  POOL_UNPOISON(o, p->size);
+  return o;
+}
 
-  // print the error string with a max of 511 characters
-  vsnprintf(v->err, 511, fmt, va);
+void lpool_free(lpool* p, int slot) {
+  p->slabs[slot / POOL_SLAB]->live[slot % POOL_SLAB] = 0;
+  POOL_POISON(lpool_at(p, slot), p->size);
+  p->free[p->free_count++] = slot;
+  p->live--;
+}
 
-  // Reallocate to a number of bytes that are used
-  v->err = realloc(v->err, strlen(v->err)+1);
+/* Garbage collector.
+
+   Every lval and lenv lives in one of the collector's pools. Reference
+   counting still frees most objects the moment they become garbage, the
+   tracing collector reclaims whatever it misses (cycles and references
+   dropped on error paths). A collection marks everything reachable from
+   the root environments and the root stack of in flight expressions and
+   sweeps the live slots of every slab.
+
+   Collections only happen at safe points between top level forms, where
+   no C code is holding on to values that are not rooted. */
+#define GC_MIN_ALLOCS 100000
+
+struct {
+  lpool lvals;
+  lpool lenvs;
+
+  lenv** root_envs;
+  int root_env_count;
+  lval** roots;
+  int root_count;
+  int root_capacity;
+
+  /* Nesting of lval_eval, collecting is only safe at zero */
+  int depth;
+  int requested;
+  long allocs;
+  long threshold;
+
+  /* Statistics, printed after every collection if GALISP_GC_TRACE is set */
+  int trace;
+  long collections;
+  long freed;
+  long last_freed;
+  double last_pause;
+  double max_pause;
+  double total_pause;
+} gc = {
+  .lvals = { .size = sizeof(lval) },
+  .lenvs = { .size = sizeof(lenv) },
+  .threshold = GC_MIN_ALLOCS
+};
 
-  // Cleanup
-  va_end(va);
+void gc_root_env(lenv* e) {
+  gc.root_envs = realloc(gc.root_envs, sizeof(lenv*) * (gc.root_env_count + 1));
+  gc.root_envs[gc.root_env_count++] = e;
+}
 
-  return v;
+void gc_root_push(lval* v) {
+  if(gc.root_count == gc.root_capacity) {
+    gc.root_capacity = gc.root_capacity ? gc.root_capacity * 2 : 16;
+    gc.roots = realloc(gc.roots, sizeof(lval*) * gc.root_capacity);
+  }
+  gc.roots[gc.root_count++] = v;
 }
 
-lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
+void gc_root_pop(void) {
+  gc.root_count--;
 }
 
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+lval* lval_new(int type) {
+  int slot;
+  lval* v = lpool_alloc(&gc.lvals, &slot);
+  v->gc_slot = slot;
+  v->gc_mark = 0;
+  gc.allocs++;
+  v->type = type;
+  v->refs = 1;
+  v->code = NULL;
   return v;
 }
 
-lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  v->cell = NULL;
+lval* lval_ref(lval* v) {
+  if(LVAL_IS_FIXNUM(v)) { return v; }
+  v->refs++;
   return v;
 }
 
-lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
+lval* lval_num(long x) {
+  if(x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
+  }
+
+  lval* v = lval_new(LVAL_NUM);
+  v->num = x;
   return v;
 }
 
-lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
+lval* lval_dbl(double x) {
+  lval* v = lval_new(LVAL_DBL);
+  v->dbl = x;
   return v;
 }
 
-void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+/* Bignums.
+
+   Integers that do not fit in a long are LVAL_BIG, a sign and a magnitude
+   of 32 bit limbs, least significant first. Arithmetic stays on longs
+   while the checked builtins report no overflow and only goes through the
+   limbs when an operand is big or a result does not fit. Results that fit
+   a long again become ordinary numbers, so a number is big exactly when it
+   has to be. Products of operands of at least BIG_KARATSUBA limbs are
+   split with Karatsuba. */
+#define BIG_KARATSUBA 32
+
+struct lbig {
+  int sign;
+  int size;
+  uint32_t limbs[];
+};
+
+/* Zeroed, positive */
+lbig* lbig_new(int size) {
+  lbig* b = calloc(1, sizeof(lbig) + sizeof(uint32_t) * size);
+  b->sign = 1;
+  b->size = size;
+  return b;
+}
+
+lbig* lbig_from_long(long x) {
+  uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  lbig* b = lbig_new(2);
+  b->sign = x < 0 ? -1 : 1;
+  b->limbs[0] = (uint32_t)m;
+  b->limbs[1] = (uint32_t)(m >> 32);
+  return b;
+}
+
+/* Size of 'a' without leading zero limbs */
+int mag_len(uint32_t* a, int n) {
+  while(n > 0 && a[n-1] == 0) { n--; }
+  return n;
+}
+
+int mag_cmp(uint32_t* a, int na, uint32_t* b, int nb) {
+  if(na != nb) { return na < nb ? -1 : 1; }
+  for (int i = na-1; i >= 0; i--) {
+    if(a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  return 0;
 }
 
-void lval_del(lval* v) {
-  switch(v->type) {
-  case LVAL_NUM: break;
-  case LVAL_FUN:
-    if(!v->builtin) {
-      lval_del(v->formals);
-      lval_del(v->body);
-      lenv_del(v->env);      
-    }
-    break;
-		
-  case LVAL_ERR: free(v->err); break;
-  case LVAL_SYM: free(v->sym); break;
-  case LVAL_STR: free(v->str); break;
-		
-  case LVAL_SEXPR: 
-  case LVAL_QEXPR: 
-    for(int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-			
-    free(v->cell);
-    break;
+/* r = a + b, with room for max(na, nb) + 1 limbs */
+void mag_add(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if(na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
   }
-	
-  free(v);
+  uint64_t carry = 0;
+  for (int i = 0; i < na; i++) {
+    uint64_t t = (uint64_t)a[i] + (i < nb ? b[i] : 0) + carry;
+    r[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  r[na] = (uint32_t)carry;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number '%d'", x);
+/* r = a - b for a >= b, with room for na limbs. 'r' may be 'a'. */
+void mag_sub(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  uint64_t borrow = 0;
+  for (int i = 0; i < na; i++) {
+    uint64_t t = (uint64_t)a[i] - (i < nb ? b[i] : 0) - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (t >> 32) & 1;
+  }
 }
 
-lval* lval_read_string(mpc_ast_t* t) {
-  char* string = t->contents;
-  string[strlen(string)-1] = '\0';
+/* r += a, where the sum fits in the nr limbs of 'r' */
+void mag_add_into(uint32_t* r, int nr, uint32_t* a, int na) {
+  uint64_t carry = 0;
+  for (int i = 0; i < nr && (i < na || carry); i++) {
+    uint64_t t = (uint64_t)r[i] + (i < na ? a[i] : 0) + carry;
+    r[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+}
 
-  char* unescaped = malloc(strlen(string+1)+1);
-  strcpy(unescaped, string+1);
+/* r = a * b, writing all na + nb limbs of 'r' */
+void mag_mul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  int m = (na > nb ? na : nb) / 2;
+
+  /* Small or lopsided operands, long multiplication */
+  if(na < BIG_KARATSUBA || nb < BIG_KARATSUBA || na <= m || nb <= m) {
+    memset(r, 0, sizeof(uint32_t) * (na + nb));
+    for (int i = 0; i < na; i++) {
+      uint64_t carry = 0;
+      for (int j = 0; j < nb; j++) {
+        uint64_t t = (uint64_t)a[i] * b[j] + r[i+j] + carry;
+        r[i+j] = (uint32_t)t;
+        carry = t >> 32;
+      }
+      r[i+nb] = (uint32_t)carry;
+    }
+    return;
+  }
 
-  unescaped = mpcf_unescape(unescaped);
+  /* a = a1 B^m + a0 and b = b1 B^m + b0, so a b is
+     z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0 */
+  int na1 = na - m;
+  int nb1 = nb - m;
+  int nsa = (na1 > m ? na1 : m) + 1;
+  int nsb = (nb1 > m ? nb1 : m) + 1;
+  uint32_t* sa = malloc(sizeof(uint32_t) * nsa);
+  uint32_t* sb = malloc(sizeof(uint32_t) * nsb);
+  mag_add(sa, a, m, a+m, na1);
+  mag_add(sb, b, m, b+m, nb1);
+  nsa = mag_len(sa, nsa);
+  nsb = mag_len(sb, nsb);
+
+  uint32_t* z1 = malloc(sizeof(uint32_t) * (nsa + nsb));
+  mag_mul(z1, sa, nsa, sb, nsb);
+  mag_mul(r, a, m, b, m);
+  mag_mul(r + 2*m, a+m, na1, b+m, nb1);
+
+  int nz1 = nsa + nsb;
+  mag_sub(z1, z1, nz1, r, mag_len(r, 2*m));
+  mag_sub(z1, z1, nz1, r + 2*m, mag_len(r + 2*m, na1 + nb1));
+  mag_add_into(r + m, na + nb - m, z1, mag_len(z1, nz1));
+
+  free(sa); free(sb); free(z1);
+}
 
-  lval* lval_string = lval_str(unescaped);
-  free(unescaped);
-  return lval_string;
+/* q = a / d, returning a % d. 'q' may be 'a'. */
+uint32_t mag_div_small(uint32_t* q, uint32_t* a, int na, uint32_t d) {
+  uint64_t rem = 0;
+  for (int i = na-1; i >= 0; i--) {
+    uint64_t t = (rem << 32) | a[i];
+    q[i] = (uint32_t)(t / d);
+    rem = t % d;
+  }
+  return (uint32_t)rem;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if(strstr(t->tag, "number")) { return lval_read_num(t); }
-  if(strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-	
-  lval* x = NULL;
-  if(strcmp(t->tag, ">") == 0) { x= lval_sexpr(); }
-  if(strstr(t->tag, "sexpr")) { x= lval_sexpr(); }
-  if(strstr(t->tag, "qexpr")) { x= lval_qexpr(); }
-  if(strstr(t->tag, "string")) { x= lval_read_string(t); }
-	
-  for (int i=0; i < t->children_num; i++) {
-    if(strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if(strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if(strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if(strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if(strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-    if(strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+/* q = a / b for a >= b and nb >= 2, with room for na - nb + 1 limbs.
+   Knuth's algorithm D, normalising so the top limb of 'b' has its high
+   bit set and each estimated quotient limb is at most two too big. */
+void mag_div(uint32_t* q, uint32_t* a, int na, uint32_t* b, int nb) {
+  int s = __builtin_clz(b[nb-1]);
+  uint32_t* bn = malloc(sizeof(uint32_t) * nb);
+  uint32_t* an = malloc(sizeof(uint32_t) * (na + 1));
+
+  for (int i = nb-1; i > 0; i--) {
+    bn[i] = (b[i] << s) | (uint32_t)((uint64_t)b[i-1] >> (32 - s));
   }
-	
-  return x;
+  bn[0] = b[0] << s;
+  an[na] = (uint32_t)((uint64_t)a[na-1] >> (32 - s));
+  for (int i = na-1; i > 0; i--) {
+    an[i] = (a[i] << s) | (uint32_t)((uint64_t)a[i-1] >> (32 - s));
+  }
+  an[0] = a[0] << s;
+
+  const uint64_t base = (uint64_t)1 << 32;
+  for (int j = na - nb; j >= 0; j--) {
+    uint64_t top = ((uint64_t)an[j+nb] << 32) | an[j+nb-1];
+    uint64_t qhat = top / bn[nb-1];
+    uint64_t rhat = top % bn[nb-1];
+    while(qhat >= base || qhat * bn[nb-2] > ((rhat << 32) | an[j+nb-2])) {
+      qhat--;
+      rhat += bn[nb-1];
+      if(rhat >= base) { break; }
+    }
+
+    /* an[j..j+nb] -= qhat * bn */
+    int64_t borrow = 0;
+    int64_t t;
+    for (int i = 0; i < nb; i++) {
+      uint64_t p = qhat * bn[i];
+      t = (int64_t)an[i+j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+      an[i+j] = (uint32_t)t;
+      borrow = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)an[j+nb] - borrow;
+    an[j+nb] = (uint32_t)t;
+
+    /* One too many, add back */
+    q[j] = (uint32_t)qhat;
+    if(t < 0) {
+      q[j]--;
+      uint64_t carry = 0;
+      for (int i = 0; i < nb; i++) {
+        uint64_t u = (uint64_t)an[i+j] + bn[i] + carry;
+        an[i+j] = (uint32_t)u;
+        carry = u >> 32;
+      }
+      an[j+nb] += (uint32_t)carry;
+    }
+  }
+
+  free(bn); free(an);
 }
 
-lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+/* Takes 'b', which goes back to being a long if it fits */
+lval* lval_big(lbig* b) {
+  b->size = mag_len(b->limbs, b->size);
+  if(b->size <= 2) {
+    uint64_t m = b->size > 0 ? b->limbs[0] : 0;
+    if(b->size == 2) { m |= (uint64_t)b->limbs[1] << 32; }
+    if(b->sign > 0 && m <= (uint64_t)LONG_MAX) {
+      free(b);
+      return lval_num((long)m);
+    }
+    if(b->sign < 0 && m <= (uint64_t)LONG_MAX + 1) {
+      free(b);
+      return lval_num(m == (uint64_t)LONG_MAX + 1 ? LONG_MIN : -(long)m);
+    }
+  }
+
+  lval* v = lval_new(LVAL_BIG);
+  v->big = b;
   return v;
 }
 
-
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-		
-    if(i != (v->count-1)) {
-      putchar(' ');
+lval* lval_read_big(char* s) {
+  int sign = 1;
+  if(*s == '-') { sign = -1; s++; }
+
+  /* Every 9 digits need less than a limb */
+  lbig* b = lbig_new(strlen(s) / 9 + 2);
+  b->sign = sign;
+  int size = 0;
+  for (; *s; s++) {
+    uint64_t carry = *s - '0';
+    for (int i = 0; i < size; i++) {
+      uint64_t t = (uint64_t)b->limbs[i] * 10 + carry;
+      b->limbs[i] = (uint32_t)t;
+      carry = t >> 32;
     }
+    if(carry) { b->limbs[size++] = (uint32_t)carry; }
   }
-  putchar(close);
+  return lval_big(b);
 }
 
-void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
+void lbig_print(lbig* b) {
+  /* Peel off 9 decimal digits at a time */
+  uint32_t* m = malloc(sizeof(uint32_t) * b->size);
+  memcpy(m, b->limbs, sizeof(uint32_t) * b->size);
+  uint32_t* chunks = malloc(sizeof(uint32_t) * (b->size * 10 / 9 + 2));
+  int count = 0;
+  int n = b->size;
+  while(n > 0) {
+    chunks[count++] = mag_div_small(m, m, n, 1000000000);
+    n = mag_len(m, n);
+  }
 
-  escaped = mpcf_escape(escaped);
+  if(b->sign < 0) { putchar('-'); }
+  printf("%u", count ? chunks[count-1] : 0);
+  for (int i = count-2; i >= 0; i--) { printf("%09u", chunks[i]); }
+  free(m); free(chunks);
+}
 
-  printf("\"%s\"", escaped);
-  free(escaped);
+int lval_is_num(lval* v) {
+  int t = lval_type(v);
+  return t == LVAL_NUM || t == LVAL_BIG || t == LVAL_DBL;
 }
 
-void lval_print(lval* v) {
-  switch (v->type) {
-  case LVAL_NUM: printf("%li", v->num); break;
-  case LVAL_ERR: printf("Error: %s", v->err); break;
-  case LVAL_SYM: printf("%s", v->sym); break;
-  case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-  case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-  case LVAL_FUN:
-    if(v->builtin) {
-      printf("<builtin>");
+/* Whether a number counts as true in a condition, any non zero value of
+   any kind does. Bignums are never zero, they would fit in a long. */
+int lval_truthy(lval* v) {
+  switch(lval_type(v)) {
+  case LVAL_BIG: return 1;
+  case LVAL_DBL: return v->dbl != 0;
+  default: return lval_to_long(v) != 0;
+  }
+}
+
+/* Floats.
+
+   LVAL_DBL is a boxed double. Arithmetic and comparisons with a float
+   among the operands are done in doubles, integers of either size being
+   converted first. */
+double lval_to_double(lval* v) {
+  switch(lval_type(v)) {
+  case LVAL_DBL: return v->dbl;
+  case LVAL_BIG: {
+    double x = 0;
+    for (int i = v->big->size-1; i >= 0; i--) { x = x * 4294967296.0 + v->big->limbs[i]; }
+    return v->big->sign * x;
+  }
+  default: return (double)lval_to_long(v);
+  }
+}
+
+int lval_any_dbl(lval** cells, int n) {
+  for (int i = 0; i < n; i++) {
+    if(lval_type(cells[i]) == LVAL_DBL) { return 1; }
+  }
+  return 0;
+}
+
+/* Sum or product of the 'n' numbers in 'cells' as doubles. They are
+   unboxed a block at a time into an array reduced in four independent
+   lanes, which the compiler can keep in one vector register. */
+#define DBL_BLOCK 64
+
+double dbl_reduce(lval** cells, int n, int product) {
+  double block[DBL_BLOCK];
+  double lane[4];
+  for (int k = 0; k < 4; k++) { lane[k] = product ? 1.0 : 0.0; }
+
+  for (int start = 0; start < n; start += DBL_BLOCK) {
+    int m = n - start < DBL_BLOCK ? n - start : DBL_BLOCK;
+    for (int i = 0; i < m; i++) { block[i] = lval_to_double(cells[start+i]); }
+    for (int i = m; i % 4; i++) { block[i] = product ? 1.0 : 0.0; }
+
+    if(product) {
+      for (int i = 0; i < m; i += 4) {
+        lane[0] *= block[i]; lane[1] *= block[i+1];
+        lane[2] *= block[i+2]; lane[3] *= block[i+3];
+      }
     } else {
-      printf("(\\ "); lval_print(v->formals); putchar(' '); lval_print(v->body); putchar(')');
+      for (int i = 0; i < m; i += 4) {
+        lane[0] += block[i]; lane[1] += block[i+1];
+        lane[2] += block[i+2]; lane[3] += block[i+3];
+      }
     }
-    break;
-  case LVAL_STR: lval_print_str(v); break;
-    
   }
+  return product ? (lane[0] * lane[1]) * (lane[2] * lane[3])
+    : (lane[0] + lane[1]) + (lane[2] + lane[3]);
+}
+
+void lval_print_dbl(double x) {
+  /* Always recognisable as a float when read back */
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.15g", x);
+  printf("%s", buffer);
+  if(!strpbrk(buffer, ".eni")) { printf(".0"); }
+}
+
+/* The limbs of a number of either size. A long is converted into '*tmp',
+   which the caller frees. */
+lbig* lbig_of(lval* v, lbig** tmp) {
+  if(lval_type(v) == LVAL_BIG) { return v->big; }
+  *tmp = lbig_from_long(lval_to_long(v));
+  return *tmp;
+}
+
+/* a + b with the sign of 'b' taken as 'bsign' */
+lval* lbig_add(lbig* a, lbig* b, int bsign) {
+  int na = mag_len(a->limbs, a->size);
+  int nb = mag_len(b->limbs, b->size);
+  lbig* r = lbig_new((na > nb ? na : nb) + 1);
+  if(a->sign == bsign) {
+    mag_add(r->limbs, a->limbs, na, b->limbs, nb);
+    r->sign = a->sign;
+  } else if(mag_cmp(a->limbs, na, b->limbs, nb) >= 0) {
+    mag_sub(r->limbs, a->limbs, na, b->limbs, nb);
+    r->sign = a->sign;
+  } else {
+    mag_sub(r->limbs, b->limbs, nb, a->limbs, na);
+    r->sign = bsign;
+  }
+  return lval_big(r);
 }
 
+/* Integer arithmetic on numbers of either size, consuming neither */
+lval* lval_num_add(lval* x, lval* y) {
+  if(lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+    return lval_dbl(lval_to_double(x) + lval_to_double(y));
+  }
+  long r;
+  if(lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM
+     && !__builtin_add_overflow(lval_to_long(x), lval_to_long(y), &r)) {
+    return lval_num(r);
+  }
+  lbig* tx = NULL;
+  lbig* ty = NULL;
+  lbig* b = lbig_of(y, &ty);
+  lval* result = lbig_add(lbig_of(x, &tx), b, b->sign);
+  free(tx); free(ty);
+  return result;
+}
 
+lval* lval_num_sub(lval* x, lval* y) {
+  if(lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+    return lval_dbl(lval_to_double(x) - lval_to_double(y));
+  }
+  long r;
+  if(lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM
+     && !__builtin_sub_overflow(lval_to_long(x), lval_to_long(y), &r)) {
+    return lval_num(r);
+  }
+  lbig* tx = NULL;
+  lbig* ty = NULL;
+  lbig* b = lbig_of(y, &ty);
+  lval* result = lbig_add(lbig_of(x, &tx), b, -b->sign);
+  free(tx); free(ty);
+  return result;
+}
 
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+lval* lval_num_mul(lval* x, lval* y) {
+  if(lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+    return lval_dbl(lval_to_double(x) * lval_to_double(y));
+  }
+  long r;
+  if(lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM
+     && !__builtin_mul_overflow(lval_to_long(x), lval_to_long(y), &r)) {
+    return lval_num(r);
+  }
+  lbig* tx = NULL;
+  lbig* ty = NULL;
+  lbig* a = lbig_of(x, &tx);
+  lbig* b = lbig_of(y, &ty);
+  int na = mag_len(a->limbs, a->size);
+  int nb = mag_len(b->limbs, b->size);
+  lbig* p = lbig_new(na + nb);
+  mag_mul(p->limbs, a->limbs, na, b->limbs, nb);
+  p->sign = a->sign * b->sign;
+  free(tx); free(ty);
+  return lval_big(p);
+}
 
-lenv* lenv_copy(lenv* env) {
-  lenv* copy = malloc((sizeof(lenv)));
-  copy->parent = env->parent;
-  copy->count = env->count;
-  copy->syms = malloc(sizeof(char*) * env->count);
-  copy->vals = malloc(sizeof(lval*) * env->count);
-  for (int i = 0; i < env->count; i++) {
-    copy->syms[i] = malloc(strlen(env->syms[i]) + 1);
-    strcpy(copy->syms[i], env->syms[i]);
-    copy->vals[i] = lval_copy(env->vals[i]);
-  }
-  return copy;
-  
+/* Truncates like C for integers, 'y' must not be zero */
+lval* lval_num_div(lval* x, lval* y) {
+  if(lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+    return lval_dbl(lval_to_double(x) / lval_to_double(y));
+  }
+  if(lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM
+     && !(lval_to_long(x) == LONG_MIN && lval_to_long(y) == -1)) {
+    return lval_num(lval_to_long(x) / lval_to_long(y));
+  }
+  lbig* tx = NULL;
+  lbig* ty = NULL;
+  lbig* a = lbig_of(x, &tx);
+  lbig* b = lbig_of(y, &ty);
+  int na = mag_len(a->limbs, a->size);
+  int nb = mag_len(b->limbs, b->size);
+
+  lbig* q;
+  if(mag_cmp(a->limbs, na, b->limbs, nb) < 0) {
+    q = lbig_new(0);
+  } else if(nb == 1) {
+    q = lbig_new(na);
+    mag_div_small(q->limbs, a->limbs, na, b->limbs[0]);
+  } else {
+    q = lbig_new(na - nb + 1);
+    mag_div(q->limbs, a->limbs, na, b->limbs, nb);
+  }
+  q->sign = a->sign * b->sign;
+  free(tx); free(ty);
+  return lval_big(q);
 }
 
-lval* lval_copy(lval* v) {
+int lval_num_cmp(lval* x, lval* y) {
+  if(lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+    double a = lval_to_double(x);
+    double b = lval_to_double(y);
+    return (a > b) - (a < b);
+  }
+  if(lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM) {
+    long a = lval_to_long(x);
+    long b = lval_to_long(y);
+    return (a > b) - (a < b);
+  }
+  lbig* tx = NULL;
+  lbig* ty = NULL;
+  lbig* a = lbig_of(x, &tx);
+  lbig* b = lbig_of(y, &ty);
+  int na = mag_len(a->limbs, a->size);
+  int nb = mag_len(b->limbs, b->size);
+
+  /* Zero has no limbs and either sign */
+  int sa = na ? a->sign : 0;
+  int sb = nb ? b->sign : 0;
+  int result = sa != sb ? (sa > sb) - (sa < sb)
+    : sa * mag_cmp(a->limbs, na, b->limbs, nb);
+  free(tx); free(ty);
+  return result;
+}
 
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+/* Vectors.
 
-  switch (v->type){
-  case LVAL_FUN:
-    if (v->builtin) {
-      x->builtin = v->builtin;
-    } else {
-      x->builtin = NULL;
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
-    }
-    break;
-  case LVAL_NUM: x->num = v->num; break;
+   LVAL_VEC packs numbers into one buffer, all longs or all doubles,
+   aligned for vector loads. The double kernels are written with AVX2 or
+   SSE2 intrinsics when the compiler targets them and fall back to plain
+   loops. The long kernels check for overflow: sums collect the
+   overflow bits branch-free (so they vectorize too) and report whether
+   anything overflowed, in which case the builtin redoes the work exactly
+   with bignums. */
+#define VEC_ALIGN 32
 
-  case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
-    strcpy(x->err, v->err); break;
-    
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym); break;
+typedef union { long l; double d; } lvec_elem;
 
-  case LVAL_STR:
-    x->str = malloc(strlen(v->str) + 1);
-    strcpy(x->str, v->str); break;
-    
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    x->count = v->count;
-    x->cell = malloc(sizeof(lval*) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
-    }
-    break;
+struct lvec {
+  int dbl;
+  int count;
+  union {
+    long* l;
+    double* d;
+  };
+};
+
+lvec* lvec_new(int dbl, int count) {
+  lvec* v = malloc(sizeof(lvec) + VEC_ALIGN + sizeof(lvec_elem) * count);
+  uintptr_t data = ((uintptr_t)(v + 1) + VEC_ALIGN - 1) & ~(uintptr_t)(VEC_ALIGN - 1);
+  v->dbl = dbl;
+  v->count = count;
+  v->l = (long*)data;
+  return v;
+}
+
+lval* lval_vec(lvec* vec) {
+  lval* v = lval_new(LVAL_VEC);
+  v->vec = vec;
+  return v;
+}
+
+void lvec_print(lvec* v) {
+  putchar('[');
+  for (int i = 0; i < v->count; i++) {
+    if(v->dbl) { lval_print_dbl(v->d[i]); } else { printf("%li", v->l[i]); }
+    if(i != v->count-1) { putchar(' '); }
   }
+  putchar(']');
+}
+
+/* The elements of 'v' as doubles, a new vector if they are longs */
+lvec* lvec_to_dbl(lvec* v) {
+  if(v->dbl) { return v; }
+  lvec* x = lvec_new(1, v->count);
+  for (int i = 0; i < v->count; i++) { x->d[i] = (double)v->l[i]; }
+  return x;
+}
+
+double vec_sum_dbl(double* x, int n) {
+  int i = 0;
+  double s = 0;
+#if defined(__AVX2__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) { acc = _mm256_add_pd(acc, _mm256_load_pd(x + i)); }
+  double lane[4];
+  _mm256_storeu_pd(lane, acc);
+  s = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+#elif defined(__SSE2__)
+  __m128d acc = _mm_setzero_pd();
+  for (; i + 2 <= n; i += 2) { acc = _mm_add_pd(acc, _mm_load_pd(x + i)); }
+  double lane[2];
+  _mm_storeu_pd(lane, acc);
+  s = lane[0] + lane[1];
+#endif
+  for (; i < n; i++) { s += x[i]; }
+  return s;
+}
+
+double vec_dot_dbl(double* x, double* y, int n) {
+  int i = 0;
+  double s = 0;
+#if defined(__AVX2__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_load_pd(x + i), _mm256_load_pd(y + i)));
+  }
+  double lane[4];
+  _mm256_storeu_pd(lane, acc);
+  s = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+#elif defined(__SSE2__)
+  __m128d acc = _mm_setzero_pd();
+  for (; i + 2 <= n; i += 2) {
+    acc = _mm_add_pd(acc, _mm_mul_pd(_mm_load_pd(x + i), _mm_load_pd(y + i)));
+  }
+  double lane[2];
+  _mm_storeu_pd(lane, acc);
+  s = lane[0] + lane[1];
+#endif
+  for (; i < n; i++) { s += x[i] * y[i]; }
+  return s;
+}
+
+/* Minimum (or maximum) of n > 0 doubles */
+double vec_min_dbl(double* x, int n, int max) {
+  int i = 0;
+  double m = x[0];
+#if defined(__AVX2__)
+  if(n >= 4) {
+    __m256d acc = _mm256_load_pd(x);
+    for (i = 4; i + 4 <= n; i += 4) {
+      __m256d y = _mm256_load_pd(x + i);
+      acc = max ? _mm256_max_pd(acc, y) : _mm256_min_pd(acc, y);
+    }
+    double lane[4];
+    _mm256_storeu_pd(lane, acc);
+    m = lane[0];
+    for (int k = 1; k < 4; k++) { m = max ? (lane[k] > m ? lane[k] : m) : (lane[k] < m ? lane[k] : m); }
+  }
+#elif defined(__SSE2__)
+  if(n >= 2) {
+    __m128d acc = _mm_load_pd(x);
+    for (i = 2; i + 2 <= n; i += 2) {
+      __m128d y = _mm_load_pd(x + i);
+      acc = max ? _mm_max_pd(acc, y) : _mm_min_pd(acc, y);
+    }
+    double lane[2];
+    _mm_storeu_pd(lane, acc);
+    m = max ? (lane[1] > lane[0] ? lane[1] : lane[0]) : (lane[1] < lane[0] ? lane[1] : lane[0]);
+  }
+#endif
+  for (; i < n; i++) { m = max ? (x[i] > m ? x[i] : m) : (x[i] < m ? x[i] : m); }
+  return m;
+}
+
+/* r = x + y, or x * y, elementwise */
+void vec_op_dbl(double* r, double* x, double* y, int n, int mul) {
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_load_pd(x + i);
+    __m256d b = _mm256_load_pd(y + i);
+    _mm256_store_pd(r + i, mul ? _mm256_mul_pd(a, b) : _mm256_add_pd(a, b));
+  }
+#elif defined(__SSE2__)
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_load_pd(x + i);
+    __m128d b = _mm_load_pd(y + i);
+    _mm_store_pd(r + i, mul ? _mm_mul_pd(a, b) : _mm_add_pd(a, b));
+  }
+#endif
+  for (; i < n; i++) { r[i] = mul ? x[i] * y[i] : x[i] + y[i]; }
+}
+
+/* Sum of n longs into '*sum', returning 0 if any partial sum overflowed.
+   Four lanes, each adding with wrap around, and the sign bit of 'over'
+   set when an addition changed the sign of both its operands. */
+int vec_sum_long(long* x, int n, long* sum) {
+  unsigned long lane[4] = { 0, 0, 0, 0 };
+  unsigned long over = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      unsigned long y = (unsigned long)x[i+k];
+      unsigned long s = lane[k] + y;
+      over |= (lane[k] ^ s) & (y ^ s);
+      lane[k] = s;
+    }
+  }
+  for (; i < n; i++) {
+    unsigned long y = (unsigned long)x[i];
+    unsigned long s = lane[0] + y;
+    over |= (lane[0] ^ s) & (y ^ s);
+    lane[0] = s;
+  }
+  if(over >> (sizeof(long) * CHAR_BIT - 1)) { return 0; }
+
+  long s = 0;
+  for (int k = 0; k < 4; k++) {
+    if(__builtin_add_overflow(s, (long)lane[k], &s)) { return 0; }
+  }
+  *sum = s;
+  return 1;
+}
+
+/* r = x + y elementwise, returning 0 on overflow */
+int vec_add_long(long* r, long* x, long* y, int n) {
+  unsigned long over = 0;
+  for (int i = 0; i < n; i++) {
+    unsigned long a = (unsigned long)x[i];
+    unsigned long b = (unsigned long)y[i];
+    unsigned long s = a + b;
+    over |= (a ^ s) & (b ^ s);
+    r[i] = (long)s;
+  }
+  return !(over >> (sizeof(long) * CHAR_BIT - 1));
+}
+
+/* r = x * y elementwise, returning 0 on overflow */
+int vec_mul_long(long* r, long* x, long* y, int n) {
+  int over = 0;
+  for (int i = 0; i < n; i++) { over |= __builtin_mul_overflow(x[i], y[i], &r[i]); }
+  return !over;
+}
+
+/* Dot product of n longs into '*dot', returning 0 on overflow */
+int vec_dot_long(long* x, long* y, int n, long* dot) {
+  long s = 0;
+  for (int i = 0; i < n; i++) {
+    long p;
+    if(__builtin_mul_overflow(x[i], y[i], &p) || __builtin_add_overflow(s, p, &s)) { return 0; }
+  }
+  *dot = s;
+  return 1;
+}
+
+/* Hash maps.
+
+   LVAL_MAP is a Swiss table: a control byte per slot holds either EMPTY,
+   DELETED or the low 7 bits of the key's hash, and slots are probed a
+   group of 16 at a time, comparing all 16 control bytes against the tag
+   in one SSE2 compare. Only slots whose tag matches have their key looked
+   at. Groups are visited in triangular steps, which reaches every group
+   of a power of two table, and the table grows before it is 7/8 full so
+   a probe always ends at an empty slot.
+
+   Keys are numbers, strings and symbols and compare strictly, the key 1
+   and the key 1.0 are different. */
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_DELETED 0xFE
+
+struct lmap {
+  int count;    // live keys
+  int used;     // live keys and tombstones
+  int capacity; // slots, zero or a power of two of at least MAP_GROUP
+  uint8_t* ctrl;
+  lval** keys;
+  lval** vals;
+};
+
+lmap* lmap_new(void) {
+  lmap* m = malloc(sizeof(lmap));
+  m->count = 0;
+  m->used = 0;
+  m->capacity = 0;
+  m->ctrl = NULL;
+  m->keys = NULL;
+  m->vals = NULL;
+  return m;
+}
+
+lval* lval_map(lmap* map) {
+  lval* v = lval_new(LVAL_MAP);
+  v->map = map;
+  return v;
+}
+
+void lmap_free(lmap* m) {
+  free(m->ctrl);
+  free(m->keys);
+  free(m->vals);
+  free(m);
+}
+
+int lmap_key_ok(lval* k) {
+  int t = lval_type(k);
+  return t == LVAL_NUM || t == LVAL_BIG || t == LVAL_DBL || t == LVAL_STR || t == LVAL_SYM;
+}
+
+uint64_t lmap_mix(uint64_t h) {
+  /* splitmix64 finalizer, numbers are often dense and need spreading */
+  h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+uint64_t lmap_hash(lval* k) {
+  switch(lval_type(k)) {
+  case LVAL_NUM: return lmap_mix((uint64_t)lval_to_long(k));
+  case LVAL_SYM: return lmap_mix(k->sym->hash);
+  case LVAL_STR: return lmap_mix(lval_str_hash(k));
+  case LVAL_DBL: {
+    /* -0.0 == 0.0, so they must hash alike */
+    double d = k->dbl == 0 ? 0 : k->dbl;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return lmap_mix(bits ^ 0x5bd1e995);
+  }
+  case LVAL_BIG: {
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)k->big->sign;
+    for (int i = 0; i < k->big->size; i++) { h = (h ^ k->big->limbs[i]) * 1099511628211ULL; }
+    return lmap_mix(h);
+  }
+  }
+  return 0;
+}
+
+int lmap_key_eq(lval* x, lval* y) {
+  if(x == y) { return 1; }
+  if(lval_type(x) != lval_type(y)) { return 0; }
+  switch(lval_type(x)) {
+  case LVAL_NUM: return lval_to_long(x) == lval_to_long(y);
+  case LVAL_BIG: return lval_num_cmp(x, y) == 0;
+  case LVAL_DBL: return x->dbl == y->dbl;
+  case LVAL_SYM: return x->sym == y->sym;
+  case LVAL_STR: return lval_str_eq(x, y);
+  }
+  return 0;
+}
+
+/* Bit i is set for each slot i of the group at 'ctrl' whose control byte
+   is 'tag' */
+unsigned lmap_match(uint8_t* ctrl, uint8_t tag) {
+#if defined(__SSE2__)
+  __m128i group = _mm_loadu_si128((__m128i*)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+  unsigned bits = 0;
+  for (int i = 0; i < MAP_GROUP; i++) { bits |= (unsigned)(ctrl[i] == tag) << i; }
+  return bits;
+#endif
+}
+
+/* The same for slots that are EMPTY or DELETED, the only bytes with the
+   top bit set */
+unsigned lmap_match_free(uint8_t* ctrl) {
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)ctrl));
+#else
+  unsigned bits = 0;
+  for (int i = 0; i < MAP_GROUP; i++) { bits |= (unsigned)(ctrl[i] >> 7) << i; }
+  return bits;
+#endif
+}
+
+/* The slot holding 'k', or -1 */
+int lmap_find(lmap* m, lval* k, uint64_t hash) {
+  if(!m->capacity) { return -1; }
+  int mask = m->capacity / MAP_GROUP - 1;
+  int g = (hash >> 7) & mask;
+  uint8_t tag = hash & 0x7F;
+  for (int step = 1; ; step++) {
+    uint8_t* ctrl = m->ctrl + g * MAP_GROUP;
+    for (unsigned bits = lmap_match(ctrl, tag); bits; bits &= bits - 1) {
+      int i = g * MAP_GROUP + __builtin_ctz(bits);
+      if(lmap_key_eq(m->keys[i], k)) { return i; }
+    }
+    if(lmap_match(ctrl, MAP_EMPTY)) { return -1; }
+    g = (g + step) & mask;
+  }
+}
+
+/* The first EMPTY or DELETED slot on the probe path of 'hash' */
+int lmap_free_slot(lmap* m, uint64_t hash) {
+  int mask = m->capacity / MAP_GROUP - 1;
+  int g = (hash >> 7) & mask;
+  for (int step = 1; ; step++) {
+    unsigned bits = lmap_match_free(m->ctrl + g * MAP_GROUP);
+    if(bits) { return g * MAP_GROUP + __builtin_ctz(bits); }
+    g = (g + step) & mask;
+  }
+}
+
+/* Rehash into a table sized for twice the live keys, dropping tombstones */
+void lmap_resize(lmap* m) {
+  int capacity = MAP_GROUP;
+  while(capacity * 7 / 8 < (m->count + 1) * 2) { capacity *= 2; }
+
+  uint8_t* ctrl = m->ctrl;
+  lval** keys = m->keys;
+  lval** vals = m->vals;
+  int old = m->capacity;
+
+  m->capacity = capacity;
+  m->used = m->count;
+  m->ctrl = malloc(capacity);
+  m->keys = malloc(sizeof(lval*) * capacity);
+  m->vals = malloc(sizeof(lval*) * capacity);
+  memset(m->ctrl, MAP_EMPTY, capacity);
+
+  for (int i = 0; i < old; i++) {
+    if(ctrl[i] & 0x80) { continue; }
+    uint64_t hash = lmap_hash(keys[i]);
+    int j = lmap_free_slot(m, hash);
+    m->ctrl[j] = hash & 0x7F;
+    m->keys[j] = keys[i];
+    m->vals[j] = vals[i];
+  }
+  free(ctrl);
+  free(keys);
+  free(vals);
+}
+
+/* Bind 'k' to 'v', taking both references */
+void lmap_put(lmap* m, lval* k, lval* v) {
+  uint64_t hash = lmap_hash(k);
+  int i = lmap_find(m, k, hash);
+  if(i >= 0) {
+    lval_del(k);
+    lval_del(m->vals[i]);
+    m->vals[i] = v;
+    return;
+  }
+
+  if((m->used + 1) * 8 > m->capacity * 7) { lmap_resize(m); }
+  i = lmap_free_slot(m, hash);
+  if(m->ctrl[i] == MAP_EMPTY) { m->used++; }
+  m->count++;
+  m->ctrl[i] = hash & 0x7F;
+  m->keys[i] = k;
+  m->vals[i] = v;
+}
+
+/* Unbind 'k', returning whether it was bound. The slot becomes a
+   tombstone so probes for keys placed after it still go past. */
+int lmap_del(lmap* m, lval* k) {
+  int i = lmap_find(m, k, lmap_hash(k));
+  if(i < 0) { return 0; }
+  lval_del(m->keys[i]);
+  lval_del(m->vals[i]);
+  m->ctrl[i] = MAP_DELETED;
+  m->count--;
+  return 1;
+}
+
+/* A copy sharing the keys and values */
+lmap* lmap_copy(lmap* m) {
+  lmap* x = lmap_new();
+  if(!m->capacity) { return x; }
+  x->count = m->count;
+  x->used = m->used;
+  x->capacity = m->capacity;
+  x->ctrl = malloc(m->capacity);
+  x->keys = malloc(sizeof(lval*) * m->capacity);
+  x->vals = malloc(sizeof(lval*) * m->capacity);
+  memcpy(x->ctrl, m->ctrl, m->capacity);
+  for (int i = 0; i < m->capacity; i++) {
+    if(m->ctrl[i] & 0x80) { continue; }
+    x->keys[i] = lval_ref(m->keys[i]);
+    x->vals[i] = lval_ref(m->vals[i]);
+  }
+  return x;
+}
+
+/* Persistent maps.
+
+   LVAL_HAMT is a hash array mapped trie. Each level of the trie takes 5
+   more bits of the key's hash, so a node has up to 32 slots, stored
+   compactly: a bitmap says which slots hold an entry inline and another
+   which hold a child node, and only the slots in use are allocated. An
+   update copies the nodes on the path to the key, at most 13 of them,
+   and shares all the others with the map it came from. Keys whose whole
+   hashes collide share a node below the last level, searched linearly.
+
+   Nodes are reference counted on their own, outside the collector's
+   pools. A map swept by the collector releases its nodes without
+   touching the entries, which are unreachable and being swept too. */
+#define HAMT_BITS 5
+#define HAMT_MAX_SHIFT 64
+
+struct lhnode {
+  int refs;
+  int entries;
+  int children;
+  uint32_t datamap;
+  uint32_t nodemap;
+  long gc_epoch;
+  // keys and values in pairs, followed by the children
+  lval* kv[];
+};
+
+lhnode* hnode_new(int entries, int children) {
+  lhnode* n = malloc(sizeof(lhnode) + sizeof(void*) * (2 * entries + children));
+  n->refs = 1;
+  n->entries = entries;
+  n->children = children;
+  n->datamap = 0;
+  n->nodemap = 0;
+  n->gc_epoch = -1;
+  return n;
+}
+
+lhnode** hnode_children(lhnode* n) { return (lhnode**)(n->kv + 2 * n->entries); }
+
+lval* lval_hamt(lhnode* trie, int count) {
+  lval* v = lval_new(LVAL_HAMT);
+  v->trie = trie;
+  v->trie_count = count;
+  return v;
+}
+
+void hnode_del(lhnode* n) {
+  if(--n->refs > 0) { return; }
+  for (int i = 0; i < 2 * n->entries; i++) { lval_del(n->kv[i]); }
+  for (int i = 0; i < n->children; i++) { hnode_del(hnode_children(n)[i]); }
+  free(n);
+}
+
+/* Drop a reference from the collector's sweep, see above */
+void hnode_release(lhnode* n) {
+  if(--n->refs > 0) { return; }
+  for (int i = 0; i < n->children; i++) { hnode_release(hnode_children(n)[i]); }
+  free(n);
+}
+
+/* A copy of 'n' without entry 'del' and with 'k' 'v' at 'ins', and
+   likewise without child 'cdel' and with 'child' at 'cins'. An index of
+   -1 skips that edit, insertion indices count after the removal. Takes
+   the references to 'k', 'v' and 'child', the bitmaps are left to the
+   caller. */
+lhnode* hnode_edit(lhnode* n, int del, int ins, lval* k, lval* v, int cdel, int cins, lhnode* child) {
+  lhnode* x = hnode_new(n->entries - (del >= 0) + (ins >= 0), n->children - (cdel >= 0) + (cins >= 0));
+  x->datamap = n->datamap;
+  x->nodemap = n->nodemap;
+
+  int j = 0;
+  for (int i = 0; i <= n->entries; i++) {
+    if(j == ins) { x->kv[2*j] = k; x->kv[2*j+1] = v; j++; }
+    if(i == n->entries) { break; }
+    if(i == del) { continue; }
+    x->kv[2*j] = lval_ref(n->kv[2*i]);
+    x->kv[2*j+1] = lval_ref(n->kv[2*i+1]);
+    j++;
+  }
+
+  lhnode** from = hnode_children(n);
+  lhnode** to = hnode_children(x);
+  j = 0;
+  for (int i = 0; i <= n->children; i++) {
+    if(j == cins) { to[j++] = child; }
+    if(i == n->children) { break; }
+    if(i == cdel) { continue; }
+    to[j] = from[i];
+    to[j++]->refs++;
+  }
+  return x;
+}
+
+int hnode_index(uint32_t map, uint32_t bit) { return __builtin_popcount(map & (bit - 1)); }
+
+uint32_t hnode_bit(uint64_t hash, int shift) { return 1u << ((hash >> shift) & 31); }
+
+lval* hnode_find(lhnode* n, lval* k, uint64_t hash) {
+  for (int shift = 0; shift < HAMT_MAX_SHIFT; shift += HAMT_BITS) {
+    uint32_t bit = hnode_bit(hash, shift);
+    if(n->datamap & bit) {
+      int i = hnode_index(n->datamap, bit);
+      return lmap_key_eq(n->kv[2*i], k) ? n->kv[2*i+1] : NULL;
+    }
+    if(!(n->nodemap & bit)) { return NULL; }
+    n = hnode_children(n)[hnode_index(n->nodemap, bit)];
+  }
+  for (int i = 0; i < n->entries; i++) {
+    if(lmap_key_eq(n->kv[2*i], k)) { return n->kv[2*i+1]; }
+  }
+  return NULL;
+}
+
+/* A node holding just the two entries, which collide at every level
+   above 'shift' */
+lhnode* hnode_pair(lval* k1, lval* v1, uint64_t h1, lval* k2, lval* v2, uint64_t h2, int shift) {
+  if(shift >= HAMT_MAX_SHIFT) {
+    lhnode* n = hnode_new(2, 0);
+    n->kv[0] = k1; n->kv[1] = v1; n->kv[2] = k2; n->kv[3] = v2;
+    return n;
+  }
+  uint32_t b1 = hnode_bit(h1, shift);
+  uint32_t b2 = hnode_bit(h2, shift);
+  if(b1 == b2) {
+    lhnode* n = hnode_new(0, 1);
+    n->nodemap = b1;
+    hnode_children(n)[0] = hnode_pair(k1, v1, h1, k2, v2, h2, shift + HAMT_BITS);
+    return n;
+  }
+  lhnode* n = hnode_new(2, 0);
+  n->datamap = b1 | b2;
+  if(b1 > b2) {
+    lval* t = k1; k1 = k2; k2 = t;
+    t = v1; v1 = v2; v2 = t;
+  }
+  n->kv[0] = k1; n->kv[1] = v1; n->kv[2] = k2; n->kv[3] = v2;
+  return n;
+}
+
+/* 'n' with 'k' bound to 'v', taking both. '*added' is set if 'k' was
+   not bound before. */
+lhnode* hnode_assoc(lhnode* n, lval* k, lval* v, uint64_t hash, int shift, int* added) {
+  if(shift >= HAMT_MAX_SHIFT) {
+    for (int i = 0; i < n->entries; i++) {
+      if(lmap_key_eq(n->kv[2*i], k)) { return hnode_edit(n, i, i, k, v, -1, -1, NULL); }
+    }
+    *added = 1;
+    return hnode_edit(n, -1, n->entries, k, v, -1, -1, NULL);
+  }
+
+  uint32_t bit = hnode_bit(hash, shift);
+  if(n->datamap & bit) {
+    int i = hnode_index(n->datamap, bit);
+    lval* old = n->kv[2*i];
+    if(lmap_key_eq(old, k)) { return hnode_edit(n, i, i, k, v, -1, -1, NULL); }
+
+    /* Two keys for one slot, both move down into a new child */
+    *added = 1;
+    lhnode* child = hnode_pair(lval_ref(old), lval_ref(n->kv[2*i+1]), lmap_hash(old),
+                               k, v, hash, shift + HAMT_BITS);
+    lhnode* x = hnode_edit(n, i, -1, NULL, NULL, -1, hnode_index(n->nodemap, bit), child);
+    x->datamap ^= bit;
+    x->nodemap |= bit;
+    return x;
+  }
+  if(n->nodemap & bit) {
+    int j = hnode_index(n->nodemap, bit);
+    lhnode* child = hnode_assoc(hnode_children(n)[j], k, v, hash, shift + HAMT_BITS, added);
+    return hnode_edit(n, -1, -1, NULL, NULL, j, j, child);
+  }
+
+  *added = 1;
+  lhnode* x = hnode_edit(n, -1, hnode_index(n->datamap, bit), k, v, -1, -1, NULL);
+  x->datamap |= bit;
+  return x;
+}
+
+/* 'n' without 'k', or NULL if 'k' is not bound. A child left with a
+   single entry is folded back into its parent, so the trie has the same
+   shape however the map was built. */
+lhnode* hnode_dissoc(lhnode* n, lval* k, uint64_t hash, int shift) {
+  if(shift >= HAMT_MAX_SHIFT) {
+    for (int i = 0; i < n->entries; i++) {
+      if(lmap_key_eq(n->kv[2*i], k)) { return hnode_edit(n, i, -1, NULL, NULL, -1, -1, NULL); }
+    }
+    return NULL;
+  }
+
+  uint32_t bit = hnode_bit(hash, shift);
+  if(n->datamap & bit) {
+    int i = hnode_index(n->datamap, bit);
+    if(!lmap_key_eq(n->kv[2*i], k)) { return NULL; }
+    lhnode* x = hnode_edit(n, i, -1, NULL, NULL, -1, -1, NULL);
+    x->datamap ^= bit;
+    return x;
+  }
+  if(!(n->nodemap & bit)) { return NULL; }
+
+  int j = hnode_index(n->nodemap, bit);
+  lhnode* child = hnode_dissoc(hnode_children(n)[j], k, hash, shift + HAMT_BITS);
+  if(!child) { return NULL; }
+  if(child->children || child->entries > 1) {
+    return hnode_edit(n, -1, -1, NULL, NULL, j, j, child);
+  }
+
+  lhnode* x;
+  if(child->entries == 1) {
+    x = hnode_edit(n, -1, hnode_index(n->datamap, bit), lval_ref(child->kv[0]), lval_ref(child->kv[1]), j, -1, NULL);
+    x->datamap |= bit;
+  } else {
+    x = hnode_edit(n, -1, -1, NULL, NULL, j, -1, NULL);
+  }
+  x->nodemap ^= bit;
+  hnode_del(child);
+  return x;
+}
+
+/* Append the keys and values under 'n' in pairs to 'out' */
+void hnode_collect(lhnode* n, lval** out, int* count) {
+  memcpy(out + *count, n->kv, sizeof(lval*) * 2 * n->entries);
+  *count += 2 * n->entries;
+  for (int i = 0; i < n->children; i++) { hnode_collect(hnode_children(n)[i], out, count); }
+}
+
+/* The entries of a map of either kind, as a new array of key value pairs */
+lval** lval_map_entries(lval* m, int* count) {
+  *count = 0;
+  if(m->type == LVAL_HAMT) {
+    lval** out = malloc(sizeof(lval*) * (2 * m->trie_count + 1));
+    hnode_collect(m->trie, out, count);
+    return out;
+  }
+  lval** out = malloc(sizeof(lval*) * (2 * m->map->count + 1));
+  for (int i = 0; i < m->map->capacity; i++) {
+    if(m->map->ctrl[i] & 0x80) { continue; }
+    out[(*count)++] = m->map->keys[i];
+    out[(*count)++] = m->map->vals[i];
+  }
+  return out;
+}
+
+void lval_map_print(lval* m) {
+  int count;
+  lval** kv = lval_map_entries(m, &count);
+  fputs("#{", stdout);
+  for (int i = 0; i < count; i += 2) {
+    if(i) { fputs(", ", stdout); }
+    lval_print(kv[i]); putchar(' '); lval_print(kv[i+1]);
+  }
+  putchar('}');
+  free(kv);
+}
+
+/* The value bound to 'k' in a map of either kind, or NULL */
+lval* lval_map_get(lval* m, lval* k) {
+  uint64_t hash = lmap_hash(k);
+  if(m->type == LVAL_HAMT) { return hnode_find(m->trie, k, hash); }
+  int i = lmap_find(m->map, k, hash);
+  return i >= 0 ? m->map->vals[i] : NULL;
+}
+
+int lval_is_map(lval* v) {
+  int t = lval_type(v);
+  return t == LVAL_MAP || t == LVAL_HAMT;
+}
+
+int lval_map_count(lval* m) { return m->type == LVAL_HAMT ? m->trie_count : m->map->count; }
+
+void hnode_mark(lhnode* n) {
+  /* Versions of a map share most of their nodes, walk each once */
+  if(n->gc_epoch == gc.collections) { return; }
+  n->gc_epoch = gc.collections;
+  for (int i = 0; i < 2 * n->entries; i++) { gc_mark_lval(n->kv[i]); }
+  for (int i = 0; i < n->children; i++) { hnode_mark(hnode_children(n)[i]); }
+}
+
+/* Room for 'len' characters and the terminator, inside 'v' when they
+   fit. Most symbols never get here, they are interned, but plenty of
+   strings and errors are a few characters long. */
+#define LVAL_SMALL sizeof(((lval*)0)->small)
+
+char* lval_text(lval* v, int len) {
+  return len < (int)LVAL_SMALL ? v->small : malloc(len + 1);
+}
+
+void lval_text_free(lval* v, char* s) {
+  if(s != v->small) { free(s); }
+}
+
+lval* lval_err(char* fmt, ...) {
+  lval* v = lval_new(LVAL_ERR);
+
+  // Create a variable list
+  va_list va;
+  va_start(va, fmt);
+
+  // Format into 512 bytes on the stack
+  char buffer[512];
+
+  // print the error string with a max of 511 characters
+  vsnprintf(buffer, 511, fmt, va);
+
+  // Keep only the bytes that are used
+  v->err = lval_text(v, strlen(buffer));
+  strcpy(v->err, buffer);
+
+  // Cleanup
+  va_end(va);
+
+  return v;
+}
+
+lval* lval_sym(char* s) {
+  lval* v = lval_new(LVAL_SYM);
+  v->sym = lsym_intern(s);
+  return v;
+}
+
+/* A string of the first 'len' characters of 's' */
+lval* lval_strn(char* s, int len) {
+  lval* v = lval_new(LVAL_STR);
+  v->str = lval_text(v, len);
+  memcpy(v->str, s, len);
+  v->str[len] = '\0';
+  v->len = len;
+  v->hash = 0;
+  return v;
+}
+
+lval* lval_str(char* s) { return lval_strn(s, strlen(s)); }
+
+/* Strings.
+
+   Appending to a string that is still bound somewhere would have to copy
+   it, so building a string piece by piece was quadratic. Concatenation
+   instead makes a rope node pointing at both halves, and the characters
+   are laid out once, when something first reads them. Short results are
+   copied straight away, a rope of a few bytes is not worth the node.
+
+   Ropes get as deep as the number of appends that built them, so they
+   are walked with an explicit stack instead of recursion. */
+#define ROPE_MIN 32
+
+/* 'x' followed by 'y', taking both */
+lval* lval_rope(lval* x, lval* y) {
+  if(x->len + y->len < ROPE_MIN) {
+    lval* v = lval_new(LVAL_STR);
+    v->len = x->len + y->len;
+    v->hash = 0;
+    v->str = lval_text(v, v->len);
+    memcpy(v->str, lval_str_chars(x), x->len);
+    memcpy(v->str + x->len, lval_str_chars(y), y->len + 1);
+    lval_del(x); lval_del(y);
+    return v;
+  }
+  lval* v = lval_new(LVAL_STR);
+  v->str = NULL;
+  v->left = x;
+  v->right = y;
+  v->len = x->len + y->len;
+  v->hash = 0;
+  return v;
+}
+
+typedef struct {
+  lval** items;
+  int count;
+  int capacity;
+} lrope_stack;
+
+void lrope_push(lrope_stack* s, lval* v) {
+  if(s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 16;
+    s->items = realloc(s->items, sizeof(lval*) * s->capacity);
+  }
+  s->items[s->count++] = v;
+}
+
+/* Drop the references a rope node holds on its halves */
+void lrope_release(lval* v) {
+  lrope_stack stack = { NULL, 0, 0 };
+  lrope_push(&stack, v->left);
+  lrope_push(&stack, v->right);
+  while(stack.count) {
+    lval* x = stack.items[--stack.count];
+    if(--x->refs > 0) { continue; }
+    if(!x->str) {
+      lrope_push(&stack, x->left);
+      lrope_push(&stack, x->right);
+    }
+    lval_free(x);
+  }
+  free(stack.items);
+}
+
+/* The characters of a string, laying out a rope in place first. The
+   string does not change as far as anyone can tell, so this is fine on
+   a shared value. */
+char* lval_str_chars(lval* v) {
+  if(v->str) { return v->str; }
+
+  char* buffer = malloc(v->len + 1);
+  char* end = buffer;
+  lrope_stack stack = { NULL, 0, 0 };
+  lrope_push(&stack, v);
+  while(stack.count) {
+    lval* x = stack.items[--stack.count];
+    if(x->str) {
+      memcpy(end, x->str, x->len);
+      end += x->len;
+    } else {
+      lrope_push(&stack, x->right);
+      lrope_push(&stack, x->left);
+    }
+  }
+  free(stack.items);
+  *end = '\0';
+
+  lrope_release(v);
+  v->str = buffer;
+  return buffer;
+}
+
+unsigned lval_str_hash(lval* v) {
+  if(!v->hash) {
+    v->hash = lsym_hash(lval_str_chars(v));
+    if(!v->hash) { v->hash = 1; }
+  }
+  return v->hash;
+}
+
+int lval_str_eq(lval* x, lval* y) {
+  if(x->len != y->len) { return 0; }
+  if(x->hash && y->hash && x->hash != y->hash) { return 0; }
+  return memcmp(lval_str_chars(x), lval_str_chars(y), x->len) == 0;
+}
+
+lval* lval_sexpr(void) {
+  lval* v = lval_new(LVAL_SEXPR);
+  v->count = 0;
+  v->capacity = 0;
+  v->offset = 0;
+  v->cell = NULL;
+  v->backing = NULL;
+  return v;
+}
+
+lval* lval_qexpr(void) {
+  lval* v = lval_new(LVAL_QEXPR);
+  v->count = 0;
+  v->capacity = 0;
+  v->offset = 0;
+  v->cell = NULL;
+  v->backing = NULL;
+  return v;
+}
+
+/* Give an empty expression room for exactly 'n' cells, which the caller
+   fills in */
+lval* lval_cells(lval* v, int n) {
+  v->cell = malloc(sizeof(lval*) * n);
+  v->count = n;
+  v->capacity = n;
+  v->offset = 0;
+  v->backing = NULL;
+  return v;
+}
+
+/* A view of 'n' cells of 'v' from 'start', sharing them rather than
+   copying. The cells stay owned by the expression that allocated them,
+   which is kept alive (and so unchanged) while the slice is. */
+lval* lval_slice(lval* v, int start, int n) {
+  lval* x = lval_new(lval_type(v));
+  x->count = n;
+  x->capacity = 0;
+  x->offset = 0;
+  x->cell = v->cell + start;
+  x->backing = lval_ref(v->backing ? v->backing : v);
+  return x;
+}
+
+/* Turn a slice into an expression owning its cells, before changing it */
+void lval_unslice(lval* v) {
+  if(!v->backing) { return; }
+  lval** cell = v->cell;
+  lval* backing = v->backing;
+  lval_cells(v, v->count);
+  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_ref(cell[i]); }
+  lval_del(backing);
+}
+
+lval* lval_fun(lbuiltin func) {
+  lval* v = lval_new(LVAL_FUN);
+  v->builtin = func;
+  return v;
+}
+
+/* Release the memory of compiled code, not its constants */
+void lcode_free(lcode* c) {
+  if(--c->refs > 0) { return; }
+  free(c->ops);
+  free(c->consts);
+  free(c->caches);
+  free(c);
+}
+
+void lcode_del(lcode* c) {
+  if(c->refs == 1) {
+    for (int i = 0; i < c->const_count; i++) {
+      lval_del(c->consts[i]);
+    }
+  }
+  lcode_free(c);
+}
+
+/* The top level environment, set once in main. Every change to it moves
+   'lenv_globals_version' on, which invalidates the call-site caches. */
+lenv* lenv_globals = NULL;
+long lenv_globals_version = 1;
+
+/* Release the memory of a single environment, not its values */
+void lenv_free(lenv* e) {
+  if(e != lenv_globals) {
+    for (int i = 0; i < e->count; i++) { e->syms[i]->locals--; }
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e->index);
+  lpool_free(&gc.lenvs, e->gc_slot);
+}
+
+void lenv_del(lenv* e) {
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
+  }
+  lenv_free(e);
+}
+
+/* Release the memory of a single value, not what it points to */
+void lval_free(lval* v) {
+  switch(v->type) {
+  case LVAL_ERR: lval_text_free(v, v->err); break;
+  case LVAL_STR: lval_text_free(v, v->str); break;
+  case LVAL_BIG: free(v->big); break;
+  case LVAL_VEC: free(v->vec); break;
+  case LVAL_MAP: lmap_free(v->map); break;
+  case LVAL_HAMT: if(v->trie) { hnode_release(v->trie); } break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR: if(!v->backing) { free(v->cell - v->offset); } break;
+  }
+  if(v->code) { lcode_free(v->code); }
+  lpool_free(&gc.lvals, v->gc_slot);
+}
+
+void lval_del(lval* v) {
+  /* Only the last reference frees, fixnums are never allocated */
+  if(LVAL_IS_FIXNUM(v) || --v->refs > 0) { return; }
+
+  if(v->code) { lcode_del(v->code); v->code = NULL; }
+
+  switch(v->type) {
+  case LVAL_FUN:
+    if(!v->builtin) {
+      lval_del(v->formals);
+      lval_del(v->body);
+      if(v->bound) { lval_del(v->bound); }
+    }
+    break;
+		
+  case LVAL_SEXPR: 
+  case LVAL_QEXPR: 
+    if(v->backing) {
+      lval_del(v->backing);
+      break;
+    }
+    for(int i = 0; i < v->count; i++) {
+      lval_del(v->cell[i]);
+    }
+    break;
+
+  case LVAL_MAP:
+    for (int i = 0; i < v->map->capacity; i++) {
+      if(v->map->ctrl[i] & 0x80) { continue; }
+      lval_del(v->map->keys[i]);
+      lval_del(v->map->vals[i]);
+    }
+    break;
+
+  case LVAL_HAMT:
+    hnode_del(v->trie);
+    v->trie = NULL;
+    break;
+
+  case LVAL_STR:
+    if(!v->str) { lrope_release(v); }
+    break;
+  }
+	
+  lval_free(v);
+}
+
+void gc_mark_lenv(lenv* e);
+
+void gc_mark_lval(lval* v) {
+  if(LVAL_IS_FIXNUM(v) || v->gc_mark) { return; }
+  v->gc_mark = 1;
+
+  if(v->code) {
+    for (int i = 0; i < v->code->const_count; i++) {
+      gc_mark_lval(v->code->consts[i]);
+    }
+  }
+
+  switch(v->type) {
+  case LVAL_FUN:
+    if(!v->builtin) {
+      gc_mark_lval(v->formals);
+      gc_mark_lval(v->body);
+      if(v->bound) { gc_mark_lval(v->bound); }
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if(v->backing) { gc_mark_lval(v->backing); }
+    for(int i = 0; i < v->count; i++) {
+      gc_mark_lval(v->cell[i]);
+    }
+    break;
+  case LVAL_MAP:
+    for (int i = 0; i < v->map->capacity; i++) {
+      if(v->map->ctrl[i] & 0x80) { continue; }
+      gc_mark_lval(v->map->keys[i]);
+      gc_mark_lval(v->map->vals[i]);
+    }
+    break;
+  case LVAL_HAMT: hnode_mark(v->trie); break;
+  case LVAL_STR:
+    if(!v->str) {
+      lrope_stack stack = { NULL, 0, 0 };
+      lrope_push(&stack, v->left);
+      lrope_push(&stack, v->right);
+      while(stack.count) {
+        lval* x = stack.items[--stack.count];
+        if(x->gc_mark) { continue; }
+        x->gc_mark = 1;
+        if(!x->str) {
+          lrope_push(&stack, x->left);
+          lrope_push(&stack, x->right);
+        }
+      }
+      free(stack.items);
+    }
+    break;
+  }
+}
+
+void gc_mark_lenv(lenv* e) {
+  /* Parents are not owned by their children, so they are not followed */
+  if(e->gc_mark) { return; }
+  e->gc_mark = 1;
+  for (int i = 0; i < e->count; i++) {
+    gc_mark_lval(e->vals[i]);
+  }
+}
+
+void gc_collect(void) {
+  clock_t start = clock();
+
+  for (int i = 0; i < gc.root_env_count; i++) { gc_mark_lenv(gc.root_envs[i]); }
+  for (int i = 0; i < gc.root_count; i++) { gc_mark_lval(gc.roots[i]); }
+
+  /* Unreachable objects are freed one by one without touching their
+     children, which are unreachable as well. */
+  long freed = 0;
+  for (int i = 0; i < gc.lvals.slab_count * POOL_SLAB; i++) {
+    if(!gc.lvals.slabs[i / POOL_SLAB]->live[i % POOL_SLAB]) { continue; }
+    lval* v = lpool_at(&gc.lvals, i);
+    if(v->gc_mark) { v->gc_mark = 0; } else { lval_free(v); freed++; }
+  }
+  for (int i = 0; i < gc.lenvs.slab_count * POOL_SLAB; i++) {
+    if(!gc.lenvs.slabs[i / POOL_SLAB]->live[i % POOL_SLAB]) { continue; }
+    lenv* e = lpool_at(&gc.lenvs, i);
+    if(e->gc_mark) { e->gc_mark = 0; } else { lenv_free(e); freed++; }
+  }
+
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  gc.collections++;
+  gc.freed += freed;
+  gc.last_freed = freed;
+  gc.last_pause = pause;
+  gc.total_pause += pause;
+  if(pause > gc.max_pause) { gc.max_pause = pause; }
+
+  /* Next collection once the heap has had a chance to double */
+  gc.allocs = 0;
+  gc.threshold = gc.lvals.live + gc.lenvs.live;
+  if(gc.threshold < GC_MIN_ALLOCS) { gc.threshold = GC_MIN_ALLOCS; }
+  gc.requested = 0;
+
+  if(gc.trace) {
+    fprintf(stderr, "gc #%li: freed %li in %.3fms, heap %li values %li environments\n",
+	    gc.collections, freed, pause * 1000, gc.lvals.live, gc.lenvs.live);
+  }
+}
+
+void gc_safepoint(void) {
+  if(gc.depth == 0 && (gc.requested || gc.allocs >= gc.threshold)) {
+    gc_collect();
+  }
+}
+
+void gc_print_stats(void) {
+  printf("gc: %li collections, %li objects freed (%li last)\n",
+	 gc.collections, gc.freed, gc.last_freed);
+  printf("gc: pause last %.3fms, max %.3fms, total %.3fms\n",
+	 gc.last_pause * 1000, gc.max_pause * 1000, gc.total_pause * 1000);
+  printf("gc: heap %li values, %li environments in %i slabs, %li allocations since last collection\n",
+	 gc.lvals.live, gc.lenvs.live, gc.lvals.slab_count + gc.lenvs.slab_count, gc.allocs);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+  if(strchr(t->contents, '.')) { return lval_dbl(strtod(t->contents, NULL)); }
+
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_read_big(t->contents);
+}
+
+lval* lval_read_string(mpc_ast_t* t) {
+  char* string = t->contents;
+  string[strlen(string)-1] = '\0';
+
+  char* unescaped = malloc(strlen(string+1)+1);
+  strcpy(unescaped, string+1);
+
+  unescaped = mpcf_unescape(unescaped);
+
+  lval* lval_string = lval_str(unescaped);
+  free(unescaped);
+  return lval_string;
+}
+
+lval* lval_read(mpc_ast_t* t) {
+  if(strstr(t->tag, "number")) { return lval_read_num(t); }
+  if(strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+	
+  lval* x = NULL;
+  if(strcmp(t->tag, ">") == 0) { x= lval_sexpr(); }
+  if(strstr(t->tag, "sexpr")) { x= lval_sexpr(); }
+  if(strstr(t->tag, "qexpr")) { x= lval_qexpr(); }
+  if(strstr(t->tag, "string")) { x= lval_read_string(t); }
+	
+  for (int i=0; i < t->children_num; i++) {
+    if(strcmp(t->children[i]->contents, "(") == 0) { continue; }
+    if(strcmp(t->children[i]->contents, ")") == 0) { continue; }
+    if(strcmp(t->children[i]->contents, "{") == 0) { continue; }
+    if(strcmp(t->children[i]->contents, "}") == 0) { continue; }
+    if(strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+    if(strstr(t->children[i]->tag, "comment")) { continue; }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+	
+  return x;
+}
+
+/* Compiled code no longer matches an expression once it is changed */
+void lval_code_drop(lval* v) {
+  if(v->code) { lcode_del(v->code); v->code = NULL; }
+}
+
+/* Make room for one more cell at the end. Space popped off the front is
+   reused once it is at least as big as what is left, otherwise the array
+   doubles, so appends are amortized O(1). */
+void lval_grow(lval* v) {
+  lval** base = v->cell - v->offset;
+  if(v->offset > 0 && v->offset >= v->count) {
+    memmove(base, v->cell, sizeof(lval*) * v->count);
+    v->cell = base;
+    v->offset = 0;
+    return;
+  }
+  v->capacity = v->capacity ? v->capacity * 2 : 4;
+  base = realloc(base, sizeof(lval*) * v->capacity);
+  v->cell = base + v->offset;
+}
+
+lval* lval_add(lval* v, lval* x) {
+  v = lval_own(v);
+  lval_unslice(v);
+  lval_code_drop(v);
+  if(v->offset + v->count == v->capacity) { lval_grow(v); }
+  v->cell[v->count++] = x;
+  return v;
+}
+
+
+void lval_expr_print(lval* v, char open, char close) {
+  putchar(open);
+  for (int i = 0; i < v->count; i++) {
+    lval_print(v->cell[i]);
+		
+    if(i != (v->count-1)) {
+      putchar(' ');
+    }
+  }
+  putchar(close);
+}
+
+void lval_print_str(lval* v) {
+  /* The escapes of mpcf_escape, written out directly */
+  char* s = lval_str_chars(v);
+  putchar('"');
+  for (int i = 0; i < v->len; i++) {
+    switch(s[i]) {
+    case '\a': fputs("\\a", stdout); break;
+    case '\b': fputs("\\b", stdout); break;
+    case '\f': fputs("\\f", stdout); break;
+    case '\n': fputs("\\n", stdout); break;
+    case '\r': fputs("\\r", stdout); break;
+    case '\t': fputs("\\t", stdout); break;
+    case '\v': fputs("\\v", stdout); break;
+    case '\\': fputs("\\\\", stdout); break;
+    case '\'': fputs("\\'", stdout); break;
+    case '"': fputs("\\\"", stdout); break;
+    case '\0': fputs("\\0", stdout); break;
+    default: putchar(s[i]);
+    }
+  }
+  putchar('"');
+}
+
+void lval_print(lval* v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM: printf("%li", lval_to_long(v)); break;
+  case LVAL_BIG: lbig_print(v->big); break;
+  case LVAL_DBL: lval_print_dbl(v->dbl); break;
+  case LVAL_VEC: lvec_print(v->vec); break;
+  case LVAL_MAP:
+  case LVAL_HAMT: lval_map_print(v); break;
+  case LVAL_ERR: printf("Error: %s", v->err); break;
+  case LVAL_SYM: printf("%s", v->sym->name); break;
+  case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
+  case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+  case LVAL_FUN:
+    if(v->builtin) {
+      printf("<builtin>");
+    } else {
+      /* A partial application shows the formals it still needs */
+      lval* formals = v->bound ? lval_slice(v->formals, v->bound->count, v->formals->count - v->bound->count) : lval_ref(v->formals);
+      printf("(\\ "); lval_print(formals); putchar(' '); lval_print(v->body); putchar(')');
+      lval_del(formals);
+    }
+    break;
+  case LVAL_STR: lval_print_str(v); break;
+    
+  }
+}
+
+
+
+void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+
+/* Shallow copy. The new node is private but its children are shared
+   with 'v', so they must be owned in turn before being changed. */
+lval* lval_copy(lval* v) {
+  if(LVAL_IS_FIXNUM(v)) { return v; }
+
+  /* A slice is copied as another view of the same cells */
+  if((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->backing) {
+    lval* x = lval_slice(v, 0, v->count);
+    x->code = v->code;
+    if(x->code) { x->code->refs++; }
+    return x;
+  }
+
+  lval* x = lval_new(v->type);
+
+  switch (v->type){
+  case LVAL_FUN:
+    if (v->builtin) {
+      x->builtin = v->builtin;
+    } else {
+      x->builtin = NULL;
+      x->bound = v->bound ? lval_ref(v->bound) : NULL;
+      x->formals = lval_ref(v->formals);
+      x->body = lval_ref(v->body);
+    }
+    break;
+  case LVAL_NUM: x->num = v->num; break;
+  case LVAL_DBL: x->dbl = v->dbl; break;
+  case LVAL_VEC:
+    x->vec = lvec_new(v->vec->dbl, v->vec->count);
+    memcpy(x->vec->l, v->vec->l, sizeof(lvec_elem) * v->vec->count);
+    break;
+  case LVAL_MAP: x->map = lmap_copy(v->map); break;
+  case LVAL_HAMT:
+    x->trie = v->trie;
+    x->trie->refs++;
+    x->trie_count = v->trie_count;
+    break;
+  case LVAL_BIG:
+    x->big = lbig_new(v->big->size);
+    x->big->sign = v->big->sign;
+    memcpy(x->big->limbs, v->big->limbs, sizeof(uint32_t) * v->big->size);
+    break;
+
+  case LVAL_ERR:
+    x->err = lval_text(x, strlen(v->err));
+    strcpy(x->err, v->err); break;
+    
+  case LVAL_SYM: x->sym = v->sym; break;
+
+  case LVAL_STR:
+    x->str = lval_text(x, v->len);
+    memcpy(x->str, lval_str_chars(v), v->len + 1);
+    x->len = v->len;
+    x->hash = v->hash;
+    break;
+    
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    lval_cells(x, v->count);
+    for (int i = 0; i < x->count; i++) {
+      x->cell[i] = lval_ref(v->cell[i]);
+    }
+    break;
+  }
+
+  /* Same contents, same code */
+  x->code = v->code;
+  if(x->code) { x->code->refs++; }
+  return x;
+}
+
+/* Take a reference to 'v' and return one that is safe to mutate. If
+   nobody else holds 'v' it is returned as is, otherwise it is copied. */
+lval* lval_own(lval* v) {
+  if(LVAL_IS_FIXNUM(v) || v->refs == 1) { return v; }
+  lval* x = lval_copy(v);
+  lval_del(v);
+  return x;
+}
+
+lenv* lenv_new(void) {
+  int slot;
+  lenv* e = lpool_alloc(&gc.lenvs, &slot);
+  e->gc_slot = slot;
+  e->gc_mark = 0;
+  gc.allocs++;
+  e->parent = NULL;
+  e->count = 0;
+  e->capacity = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->index = NULL;
+  e->index_size = 0;
+  return e;
+}
+
+void lenv_index_insert(lenv* e, int i) {
+  unsigned long mask = e->index_size - 1;
+  unsigned long slot = e->syms[i]->hash & mask;
+  /* Linear probing, the index is never more than half full */
+  while(e->index[slot]) { slot = (slot + 1) & mask; }
+  e->index[slot] = i + 1;
+}
+
+void lenv_index_rebuild(lenv* e) {
+  int size = e->index_size ? e->index_size : 4 * LENV_HASH_MIN;
+  while(size < e->count * 2) { size *= 2; }
+
+  free(e->index);
+  e->index = calloc(size, sizeof(int));
+  e->index_size = size;
+  for (int i = 0; i < e->count; i++) {
+    lenv_index_insert(e, i);
+  }
+}
+
+/* Position of the binding for 'k' in this environment only, or -1 */
+int lenv_find(lenv* e, lsym* k) {
+  if(e == lenv_globals) { return k->global; }
+
+  if(!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if(e->syms[i] == k) { return i; }
+    }
+    return -1;
+  }
+
+  unsigned long mask = e->index_size - 1;
+  unsigned long slot = k->hash & mask;
+  while(e->index[slot]) {
+    int i = e->index[slot] - 1;
+    if(e->syms[i] == k) { return i; }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+lval* lval_lambda(lval* formals, lval* body) {
+  lval* funct = lval_new(LVAL_FUN);
+
+  funct->builtin = NULL;
+
+  funct->bound = NULL;
+  funct->formals = formals;
+  funct->body = body;
+  return funct;
+
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  /* Walk up the environments until one binds the symbol */
+  while(e) {
+    int i = lenv_find(e, k->sym);
+    /* If it does , return a reference to the value */
+    if(i >= 0) {
+      return lval_ref(e->vals[i]);
+    }
+    e = e->parent;
+  }
+
+  /* If no symbol found return error */
+  return lval_err("unbound symbol! '%s'", k->sym->name);
+}
+
+/* lenv_get for a call site, filling in its cache when the symbol
+   resolves to a global nothing can shadow */
+lval* lenv_load(lenv* e, lval* k, lcache* cache) {
+  while(e) {
+    int i = lenv_find(e, k->sym);
+    if(i >= 0) {
+      if(e == lenv_globals && !k->sym->locals) {
+        cache->value = e->vals[i];
+        cache->version = lenv_globals_version;
+      }
+      return lval_ref(e->vals[i]);
+    }
+    e = e->parent;
+  }
+  return lval_err("unbound symbol! '%s'", k->sym->name);
+}
+
+void lenv_put_sym(lenv* e, lsym* k, lval* v) {
+  if(e == lenv_globals) { lenv_globals_version++; }
+
+  /* Checks if variables exist */
+  int i = lenv_find(e, k);
+
+  /* if found, delete and overwrite */
+  if(i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_ref(v);
+    return;
+  }
+
+  /* If nothing found, create new. Double the arrays when full */
+  if(e->count == e->capacity) {
+    e->capacity = e->capacity ? e->capacity * 2 : 4;
+    e->vals = realloc(e->vals, sizeof(lval*) * e->capacity);
+    e->syms = realloc(e->syms, sizeof(lsym*) * e->capacity);
+  }
+  e->count++;
+
+  /* Share the value with the caller */
+  e->vals[e->count-1] = lval_ref(v);
+  e->syms[e->count-1] = k;
+
+  if(e == lenv_globals) {
+    k->global = e->count-1;
+    return;
+  }
+  k->locals++;
+
+  /* Switch to (or keep up) the hash index once the environment is big */
+  if(e->index && e->count * 2 <= e->index_size) {
+    lenv_index_insert(e, e->count-1);
+  } else if(e->count > LENV_HASH_MIN) {
+    lenv_index_rebuild(e);
+  }
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+  lenv_put_sym(e, k->sym, v);
+}
+
+/* def binds at the top level only, writing the one global slot */
+void lenv_def(lenv* env, lval* name, lval* value) {
+  lenv_put(lenv_globals, name, value);
+}
+
+lval* lval_join(lval* x, lval* y) {
+  x = lval_own(x);
+  lval_unslice(x);
+  lval_code_drop(x);
+
+  /* Grow 'x' once for all of 'y' */
+  int needed = x->offset + x->count + y->count;
+  if(needed > x->capacity) {
+    x->capacity = needed > x->capacity * 2 ? needed : x->capacity * 2;
+    lval** base = realloc(x->cell - x->offset, sizeof(lval*) * x->capacity);
+    x->cell = base + x->offset;
+  }
+
+  /* Add each cell in 'y' to 'x', moving them if 'y' owns them and
+     nobody else has it */
+  int move = y->refs == 1 && !y->backing;
+  for (int i = 0; i < y->count; i++) {
+    x->cell[x->count++] = move ? y->cell[i] : lval_ref(y->cell[i]);
+  }
+  if(move) { y->count = 0; }
+
+  lval_del(y);
+  return x;
+}
+
+lval* lval_pop(lval* v, int i) {
+  lval_code_drop(v);
+
+  /* A slice can give up either end of its view */
+  if(v->backing && (i == 0 || i == v->count-1)) {
+    lval* x = lval_ref(v->cell[i]);
+    if(i == 0) { v->cell++; }
+    v->count--;
+    return x;
+  }
+  lval_unslice(v);
+  lval* x = v->cell[i];
+
+  /* The front just moves forward, anything else closes the gap */
+  if(i == 0) {
+    v->cell++;
+    v->offset++;
+  } else {
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  }
+  v->count--;
+
+  return x;
+}
+	 
+lval* lval_take(lval* v, int i) {
+  lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+
+lval* builtin_head(lenv* e, lval* qexpr) {
+  LASSERT(qexpr, qexpr->count == 1 , "Function 'head' passed too many arguments. Got %i, Expected %i", qexpr->count, 1);
+  LASSERT(qexpr, lval_type(qexpr->cell[0]) == LVAL_QEXPR , "Function 'head' passed incorrect type!, Got %s, Expected %s.", ltype_name(lval_type(qexpr->cell[0])), ltype_name(LVAL_QEXPR));
+  LASSERT(qexpr, qexpr->cell[0]->count != 0 , "Function 'head' passed {}");
+
+  //A single cell is cheaper to copy than to keep the list alive for
+  lval* first = lval_cells(lval_qexpr(), 1);
+  first->cell[0] = lval_ref(qexpr->cell[0]->cell[0]);
+  lval_del(qexpr);
+  return first;
+}
+
+	 
+lval* builtin_tail(lenv* e, lval* qexpr) {
+  LASSERT(qexpr, qexpr->count == 1 , "Function 'tail' passed too many arguments Got %i, Expected %i", qexpr->count, 1);
+  LASSERT(qexpr, lval_type(qexpr->cell[0]) == LVAL_QEXPR , "Function 'tail' passed incorrect type! Got %s, Expected %s.", ltype_name(lval_type(qexpr->cell[0])), ltype_name(LVAL_QEXPR));
+  LASSERT(qexpr, qexpr->cell[0]->count != 0 , "Function 'tail' passed {}");
+
+  //Everything but the first one, in place
+  lval* list = qexpr->cell[0];
+  lval* rest = lval_slice(list, 1, list->count - 1);
+  lval_del(qexpr);
+  return rest;
+}
+
+
+lval* builtin_list(lenv* e, lval* a) {
+  a = lval_own(a);
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* lval_eval_expr(lenv* e, lval* v);
+
+lval* builtin_eval(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function, 'eval' passed too many arguments! Got %i, Expected %i", a->count, 1);
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, "Function 'eval' passed incorrect type! Got %s, Expected %s.", ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR));
+
+  /* Run the Q-expression as an S-expression, compiling it on demand */
+  lval* x = lval_take(a, 0);
+  lval* result = lval_eval_expr(e, x);
+  lval_del(x);
+  return result;
+}
+
+/* Bytecode.
+
+   Expressions are compiled the first time they are evaluated and the code
+   is cached on the expression (or, for a lambda body, on the function).
+   An S-expression compiles to code pushing the value of each child
+   followed by OP_CALL, which applies the same rules as the tree walking
+   evaluator did: the first error wins, an empty expression is itself, a
+   single element is its value, otherwise the head is called.
+
+   In a lambda body the formals are resolved to slots of the activation
+   environment, which lval_call fills in the order of the formals. This
+   happens once, when '\' builds the function. Every other symbol is
+   still looked up by name: scoping is dynamic, the parent of a frame is
+   whichever environment made the call, so a free symbol has no fixed
+   (depth, slot) and may be bound by a caller or a later def, which is
+   also why an unbound symbol cannot be reported before it is evaluated.
+
+   Each OP_LOAD has a cache for the common case of a global function or
+   variable. While no frame binds the symbol (its 'locals' count is 0)
+   only the global can be in scope, and the cached value stands for as
+   long as the top level environment keeps its version.
+
+   (if c {a} {b}) is compiled with both branches inline when 'if' is still
+   the builtin at run time, and falls back to an ordinary call otherwise.
+
+   A call whose value is the value of the whole expression (the body
+   itself, or the chosen branch of an if) is an OP_TAILCALL. vm_run does
+   not recurse for those when the callee is a lambda, eval or if, it
+   switches to the callee's code in the same loop, so tail recursion runs
+   in constant C stack.
+
+   Compiling alone buys little: the dispatch it saves is small next to a
+   name lookup for every symbol and an argument list for every call. The
+   speed comes from the OP_LOAD caches, the global slots behind them, and
+   vm_apply binding lambda arguments straight from the VM stack. */
+enum { OP_CONST, OP_LOCAL, OP_LOAD, OP_CALL, OP_TAILCALL, OP_IF, OP_JUMP, OP_RETURN };
+
+lval* builtin_if(lenv* env, lval* values);
+lval* lval_call(lenv* env, lval* fun, lval* values);
+lenv* lval_bind(lval* fun, lval** values, int n, lval** result);
+lval* lval_apply(lenv* env, lval* fun, lval** values, int n);
+
+lcode* lcode_new(void) {
+  lcode* c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->ops = NULL;
+  c->count = 0;
+  c->capacity = 0;
+  c->consts = NULL;
+  c->const_count = 0;
+  c->const_capacity = 0;
+  c->caches = NULL;
+  c->cache_count = 0;
+  c->max_stack = 0;
+  return c;
+}
+
+int lcode_emit(lcode* c, int op) {
+  if(c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+  }
+  c->ops[c->count] = op;
+  return c->count++;
+}
+
+/* Takes the reference to 'v' */
+int lcode_const(lcode* c, lval* v) {
+  if(c->const_count == c->const_capacity) {
+    c->const_capacity = c->const_capacity ? c->const_capacity * 2 : 8;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->const_capacity);
+  }
+  c->consts[c->const_count] = v;
+  return c->const_count++;
+}
+
+/* A new, empty call-site cache */
+int lcode_cache(lcode* c) {
+  c->caches = realloc(c->caches, sizeof(lcache) * (c->cache_count + 1));
+  c->caches[c->cache_count].value = NULL;
+  c->caches[c->cache_count].version = 0;
+  return c->cache_count++;
+}
+
+void lcode_push(lcode* c, int* depth, int n) {
+  *depth += n;
+  if(*depth > c->max_stack) { c->max_stack = *depth; }
+}
+
+/* Slot of 's' in an activation environment for 'formals', or -1. Slots
+   follow the order lval_call binds in, skipping '&' and repeated names. */
+int lcode_slot(lval* formals, lsym* s) {
+  if(!formals) { return -1; }
+  int slot = 0;
+  for (int i = 0; i < formals->count; i++) {
+    lsym* f = formals->cell[i]->sym;
+    if(f == lsym_rest) { continue; }
+
+    int seen = 0;
+    for (int j = 0; j < i; j++) {
+      if(formals->cell[j]->sym == f) { seen = 1; break; }
+    }
+    if(seen) { continue; }
+
+    if(f == s) { return slot; }
+    slot++;
+  }
+  return -1;
+}
+
+void lcode_compile_expr(lcode* c, lval* v, lval* formals, int* depth);
+
+/* Compile 'v' as an S-expression, whatever its type. 'tail' is set when
+   its value is the value of the code being compiled. */
+void lcode_compile_sexpr(lcode* c, lval* v, lval* formals, int* depth, int tail) {
+  if(v->count == 0) {
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, lval_sexpr()));
+    lcode_push(c, depth, 1);
+    return;
+  }
+
+  if(v->count == 4 && lval_type(v->cell[0]) == LVAL_SYM
+     && strcmp(v->cell[0]->sym->name, "if") == 0
+     && lval_type(v->cell[2]) == LVAL_QEXPR
+     && lval_type(v->cell[3]) == LVAL_QEXPR) {
+    lcode_compile_expr(c, v->cell[0], formals, depth);
+    lcode_compile_expr(c, v->cell[1], formals, depth);
+
+    /* OP_IF else generic, pops the function and condition when it
+       takes one of the inline branches */
+    int branch = lcode_emit(c, OP_IF);
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+    *depth -= 2;
+
+    lcode_compile_sexpr(c, v->cell[2], formals, depth, tail);
+    *depth -= 1;
+    lcode_emit(c, OP_JUMP);
+    int then_end = lcode_emit(c, 0);
+
+    c->ops[branch+1] = c->count;
+    lcode_compile_sexpr(c, v->cell[3], formals, depth, tail);
+    *depth -= 1;
+    lcode_emit(c, OP_JUMP);
+    int else_end = lcode_emit(c, 0);
+
+    c->ops[branch+2] = c->count;
+    *depth += 2;
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, lval_ref(v->cell[2])));
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, lval_ref(v->cell[3])));
+    lcode_push(c, depth, 2);
+    lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+    lcode_emit(c, 4);
+    *depth -= 3;
+
+    c->ops[then_end] = c->count;
+    c->ops[else_end] = c->count;
+    return;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i], formals, depth);
+  }
+  lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, v->count);
+  *depth -= v->count - 1;
+}
+
+void lcode_compile_expr(lcode* c, lval* v, lval* formals, int* depth) {
+  switch(lval_type(v)) {
+  case LVAL_SYM: {
+    int slot = lcode_slot(formals, v->sym);
+    if(slot >= 0) {
+      lcode_emit(c, OP_LOCAL);
+      lcode_emit(c, slot);
+    } else {
+      lcode_emit(c, OP_LOAD);
+      lcode_emit(c, lcode_const(c, lval_ref(v)));
+      lcode_emit(c, lcode_cache(c));
+    }
+    lcode_push(c, depth, 1);
+    break;
+  }
+  case LVAL_SEXPR:
+    /* () evaluates to itself */
+    if(v->count == 0) {
+      lcode_emit(c, OP_CONST);
+      lcode_emit(c, lcode_const(c, lval_ref(v)));
+      lcode_push(c, depth, 1);
+    } else {
+      lcode_compile_sexpr(c, v, formals, depth, 0);
+    }
+    break;
+  default:
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, lval_ref(v)));
+    lcode_push(c, depth, 1);
+    break;
+  }
+}
+
+lcode* lcode_compile(lval* v, lval* formals) {
+  lcode* c = lcode_new();
+  int depth = 0;
+  lcode_compile_sexpr(c, v, formals, &depth, 1);
+  lcode_emit(c, OP_RETURN);
+  return c;
+}
+
+/* Apply the S-expression rules to the 'n' values on top of the stack */
+lval* vm_apply(lenv* e, lval** values, int n) {
+  for (int i = 0; i < n; i++) {
+    if(lval_type(values[i]) == LVAL_ERR) {
+      lval* err = values[i];
+      for (int j = 0; j < n; j++) {
+	if(j != i) { lval_del(values[j]); }
+      }
+      return err;
+    }
+  }
+
+  if(n == 1) { return values[0]; }
+
+  /* ensure first element is a function. */
+  lval* f = values[0];
+  if(lval_type(f) != LVAL_FUN) {
+    for (int i = 0; i < n; i++) { lval_del(values[i]); }
+    return lval_err("S-expression does not start with symbol!");
+  }
+
+  /* Lambdas bind straight from the stack */
+  if(!f->builtin) {
+    lval* result = lval_apply(e, f, values+1, n-1);
+    for (int i = 0; i < n; i++) { lval_del(values[i]); }
+    return result;
+  }
+
+  /* Arguments go straight from the stack into the argument list */
+  lval* args = lval_cells(lval_sexpr(), n-1);
+  memcpy(args->cell, values+1, sizeof(lval*) * (n-1));
+
+  return lval_call(e, f, args);
+}
+
+/* Switch a tail call to the code of 'next', the value of the call being
+   the value of that code, run in 'frame' if the callee is a lambda. A
+   call that needs no code to run, a partial application or a failed
+   binding, leaves its value in 'result' instead. Returns 0 if the call
+   has to be made normally. */
+int vm_tail(lval** values, int n, lcode** next, lenv** frame, lval** result) {
+  *next = NULL;
+  *frame = NULL;
+  if(n < 2 || lval_type(values[0]) != LVAL_FUN) { return 0; }
+  for (int i = 1; i < n; i++) {
+    if(lval_type(values[i]) == LVAL_ERR) { return 0; }
+  }
+
+  lval* f = values[0];
+  lval* x = NULL;
+  if(f->builtin == builtin_eval) {
+    if(n != 2 || lval_type(values[1]) != LVAL_QEXPR) { return 0; }
+    x = values[1];
+    lval_del(f);
+  } else if(f->builtin == builtin_if) {
+    if(n != 4 || !lval_is_num(values[1])
+       || lval_type(values[2]) != LVAL_QEXPR
+       || lval_type(values[3]) != LVAL_QEXPR) { return 0; }
+    int taken = lval_truthy(values[1]);
+    x = values[taken ? 2 : 3];
+    lval_del(f); lval_del(values[1]); lval_del(values[taken ? 3 : 2]);
+  } else if(f->builtin) {
+    return 0;
+  }
+
+  if(x) {
+    if(!x->code) { x->code = lcode_compile(x, NULL); }
+    *next = x->code;
+    (*next)->refs++;
+    lval_del(x);
+    return 1;
+  }
+
+  *frame = lval_bind(f, values+1, n-1, result);
+  if(*frame) {
+    *next = f->code;
+    (*next)->refs++;
+  }
+  for (int i = 0; i < n; i++) { lval_del(values[i]); }
+  return 1;
+}
+
+lval* vm_run(lenv* e, lcode* c) {
+  lval* local[c->max_stack + 1];
+  lval** stack = local;
+  int size = c->max_stack + 1;
+  int top = 0;
+  int pc = 0;
+
+  /* Frames entered by tail calls belong to this run, 'owner' is the
+     current one. Bindings of frames left behind that callees can still
+     see are merged into 'carry', in place of a chain of old frames. */
+  lenv* owner = NULL;
+  lenv* carry = NULL;
+
+  /* Keep the code alive even if running it redefines its owner */
+  c->refs++;
+  gc.depth++;
+
+  while(1) {
+    switch(c->ops[pc]) {
+    case OP_CONST:
+      stack[top++] = lval_ref(c->consts[c->ops[pc+1]]);
+      pc += 2;
+      break;
+
+    case OP_LOCAL:
+      stack[top++] = lval_ref(e->vals[c->ops[pc+1]]);
+      pc += 2;
+      break;
+
+    case OP_LOAD: {
+      /* A cached global is still the binding in scope if the top level
+         has not changed and no frame binds the symbol */
+      lval* k = c->consts[c->ops[pc+1]];
+      lcache* cache = &c->caches[c->ops[pc+2]];
+      if(cache->version == lenv_globals_version && !k->sym->locals) {
+        stack[top++] = lval_ref(cache->value);
+      } else {
+        stack[top++] = lenv_load(e, k, cache);
+      }
+      pc += 3;
+      break;
+    }
+
+    case OP_CALL: {
+      int n = c->ops[pc+1];
+      top -= n;
+      stack[top] = vm_apply(e, stack + top, n);
+      top++;
+      pc += 2;
+      break;
+    }
+
+    case OP_TAILCALL: {
+      int n = c->ops[pc+1];
+      top -= n;
+
+      lcode* next;
+      lenv* frame;
+      lval* result;
+      if(!vm_tail(stack + top, n, &next, &frame, &result)) {
+        stack[top] = vm_apply(e, stack + top, n);
+        top++;
+        pc += 2;
+        break;
+      }
+
+      if(!next) {
+        stack[top++] = result;
+        pc += 2;
+        break;
+      }
+
+      if(frame) {
+        /* Callers see the bindings of the frame making the call, so the
+           frame can only be dropped if the callee shadows all of them */
+        int shadowed = 1;
+        for (int i = 0; i < e->count; i++) {
+          if(lenv_find(frame, e->syms[i]) < 0) { shadowed = 0; break; }
+        }
+
+        if(shadowed || !owner) {
+          frame->parent = shadowed ? e->parent : e;
+        } else {
+          if(e->parent != carry) {
+            carry = lenv_new();
+            carry->parent = e->parent;
+          }
+          for (int i = 0; i < e->count; i++) {
+            lenv_put_sym(carry, e->syms[i], e->vals[i]);
+          }
+          frame->parent = carry;
+        }
+        if(owner) { lenv_del(owner); }
+        owner = frame;
+        e = frame;
+      }
+
+      lcode_del(c);
+      c = next;
+      if(c->max_stack + 1 > size) {
+        if(stack != local) { free(stack); }
+        size = c->max_stack + 1;
+        stack = malloc(sizeof(lval*) * size);
+      }
+      pc = 0;
+      break;
+    }
+
+    case OP_IF: {
+      lval* f = stack[top-2];
+      lval* cond = stack[top-1];
+      if(lval_type(f) != LVAL_FUN || f->builtin != builtin_if
+	 || !lval_is_num(cond)) {
+	pc = c->ops[pc+2];
+	break;
+      }
+      int taken = lval_truthy(cond);
+      lval_del(f); lval_del(cond);
+      top -= 2;
+      pc = taken ? pc + 3 : c->ops[pc+1];
+      break;
+    }
+
+    case OP_JUMP:
+      pc = c->ops[pc+1];
+      break;
+
+    case OP_RETURN: {
+      lval* result = stack[top-1];
+      if(stack != local) { free(stack); }
+      if(owner) { lenv_del(owner); }
+      if(carry) { lenv_del(carry); }
+      gc.depth--;
+      lcode_del(c);
+      return result;
+    }
+    }
+  }
+}
+
+/* Evaluate an expression as an S-expression, without consuming it */
+lval* lval_eval_expr(lenv* e, lval* v) {
+  if(!v->code) { v->code = lcode_compile(v, NULL); }
+  return vm_run(e, v->code);
+}
+
+/* Bind the 'n' arguments in 'values' to the formals of the lambda 'fun'
+   in a fresh activation environment, leaving both untouched. Returns the
+   environment once every formal is bound, otherwise NULL with the
+   partially applied function or an error in 'result'.
+
+   A partial application is the same lambda, sharing formals, body and
+   code, with the arguments supplied so far in 'bound'. They go to the
+   first formals ahead of 'values', and each further partial step makes
+   one function and one argument vector. */
+lenv* lval_bind(lval* fun, lval** values, int n, lval** result) {
+  if(!fun->code) { fun->code = lcode_compile(fun->body, fun->formals); }
+
+  lval* formals = fun->formals;
+  lval* bound = fun->bound;
+  int carried = bound ? bound->count : 0;
+  int total = carried + n;
+  lenv* frame = lenv_new();
+  frame->capacity = formals->count;
+  frame->syms = malloc(sizeof(lsym*) * frame->capacity);
+  frame->vals = malloc(sizeof(lval*) * frame->capacity);
+
+  int i = 0;
+  for (int j = 0; j < total; j++) {
+    if(i == formals->count) {
+      lenv_del(frame);
+      *result = lval_err("function passed too many arguments, expected %i, got %i", total, formals->count);
+      return NULL;
+    }
+
+    lsym* sym = formals->cell[i++]->sym;
+    if(sym == lsym_rest) {
+      if(i != formals->count - 1) {
+        lenv_del(frame);
+        *result = lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+        return NULL;
+      }
+
+      lval* rest = lval_cells(lval_qexpr(), total - j);
+      for (int k = 0; k < rest->count; k++) {
+        rest->cell[k] = lval_ref(j+k < carried ? bound->cell[j+k] : values[j+k-carried]);
+      }
+      lenv_put_sym(frame, formals->cell[i++]->sym, rest);
+      lval_del(rest);
+      break;
+    }
+
+    lenv_put_sym(frame, sym, j < carried ? bound->cell[j] : values[j-carried]);
+  }
+
+  /* Nothing left for a trailing '& rest' */
+  if(i < formals->count && formals->cell[i]->sym == lsym_rest) {
+    if(i + 1 < formals->count) {
+      lval* val = lval_qexpr();
+      lenv_put_sym(frame, formals->cell[i+1]->sym, val);
+      lval_del(val);
+    }
+    i += 2;
+  }
+
+  if(i >= formals->count) { return frame; }
+
+  lenv_del(frame);
+  lval* args = lval_cells(lval_qexpr(), total);
+  for (int k = 0; k < carried; k++) { args->cell[k] = lval_ref(bound->cell[k]); }
+  for (int k = 0; k < n; k++) { args->cell[carried+k] = lval_ref(values[k]); }
+
+  lval* partial = lval_new(LVAL_FUN);
+  partial->builtin = NULL;
+  partial->bound = args;
+  partial->formals = lval_ref(formals);
+  partial->body = lval_ref(fun->body);
+  partial->code = fun->code;
+  partial->code->refs++;
+  *result = partial;
+  return NULL;
+}
+
+/* Call the lambda 'fun' with the 'n' arguments in 'values' from 'env',
+   consuming neither */
+lval* lval_apply(lenv* env, lval* fun, lval** values, int n) {
+  lval* result;
+  lenv* frame = lval_bind(fun, values, n, &result);
+  if(frame) {
+    frame->parent = env;
+    result = vm_run(frame, fun->code);
+    lenv_del(frame);
+  }
+  return result;
+}
+
+/* Consumes both 'fun' and 'values' */
+lval* lval_call(lenv* env, lval* fun, lval* values) {
+  lval* result;
+  if(fun->builtin) {
+    result = fun->builtin(env, values);
+  } else {
+    result = lval_apply(env, fun, values->cell, values->count);
+    lval_del(values);
+  }
+  lval_del(fun);
+  return result;
+}
+
+lval* lval_eval(lenv* e,lval* v) {
+  if(lval_type(v) == LVAL_SYM) {
+    lval* x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  if(lval_type(v) == LVAL_SEXPR) {
+    lval* x = lval_eval_expr(e, v);
+    lval_del(v);
+    return x;
+  }
+  return v;
+}
+
+
+
+lval* builtin_join(lenv* e, lval* a) {
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR, "Function 'join' passed incorrect type Got %s, Expected %s.", ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR));
+  }
+
+  lval* x = lval_own(lval_pop(a, 0));
+
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+/* List functions the library used to define. They behave like the
+   recursive lambdas did, elements are evaluated wherever those took them
+   with 'fst', but loop in C over the cells in place. */
+int lval_eq(lval* first, lval* second);
+
+/* Call 'f' with 'x' and, unless it is NULL, 'y', consuming none of them */
+lval* lval_call2(lenv* e, lval* f, lval* x, lval* y) {
+  lval* values[3] = { lval_ref(f), lval_ref(x), y ? lval_ref(y) : NULL };
+  return vm_apply(e, values, y ? 3 : 2);
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  long n = a->cell[0]->count;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+  long n = lval_to_long(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n < l->count, "Function 'nth' passed index %li of a list of %i", n, l->count);
+
+  lval* x = lval_eval(e, lval_ref(l->cell[n]));
+  lval_del(a);
   return x;
 }
 
-lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
-  e->parent = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count != 0, "Function 'last' passed {}");
+
+  lval* l = a->cell[0];
+  lval* x = lval_eval(e, lval_ref(l->cell[l->count-1]));
+  lval_del(a);
+  return x;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-  lval* funct = malloc(sizeof(lval));
-  funct->type = LVAL_FUN;
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
 
-  funct->builtin = NULL;
+  long n = lval_to_long(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n <= l->count, "Function 'take' passed %li of a list of %i", n, l->count);
 
-  funct->env = lenv_new();
-  funct->formals = formals;
-  funct->body = body;
-  return funct;
+  lval* x = lval_slice(l, 0, n);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
 
+  long n = lval_to_long(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n <= l->count, "Function 'drop' passed %li of a list of %i", n, l->count);
+
+  lval* x = lval_slice(l, n, l->count - n);
+  lval_del(a);
+  return x;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-  /*iterate over all items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /*Check if the stored string matches the symbol string */
-    /* If it does , return a copy of the value */
-    if(strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+lval* builtin_elem(lenv* e, lval* a) {
+  LASSERT_NUM("elem", a, 2);
+  LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+
+  lval* l = a->cell[1];
+  long found = 0;
+  for (int i = 0; i < l->count && !found; i++) {
+    lval* y = lval_eval(e, lval_ref(l->cell[i]));
+    if(lval_type(y) == LVAL_ERR) { lval_del(a); return y; }
+    found = lval_eq(a->cell[0], y);
+    lval_del(y);
   }
+  lval_del(a);
+  return lval_num(found);
+}
 
-  if(e->parent) {
-    return lenv_get(e->parent, k);
-  } else {
-    /* If no symbol found return error */
-    return lval_err("unbound symbol! '%s'", k->sym);
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* result = lval_cells(lval_qexpr(), l->count);
+  result->count = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_eval(e, lval_ref(l->cell[i]));
+    lval* y = lval_type(x) == LVAL_ERR ? x : lval_call2(e, f, x, NULL);
+    if(x != y) { lval_del(x); }
+    if(lval_type(y) == LVAL_ERR) { lval_del(result); lval_del(a); return y; }
+    result->cell[result->count++] = y;
   }
+  lval_del(a);
+  return result;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  /* Checks if variables exist */
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* result = lval_cells(lval_qexpr(), l->count);
+  result->count = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval* x = lval_eval(e, lval_ref(l->cell[i]));
+    lval* keep = lval_type(x) == LVAL_ERR ? x : lval_call2(e, f, x, NULL);
+    if(x != keep) { lval_del(x); }
+    if(!lval_is_num(keep)) {
+      lval_del(result); lval_del(a);
+      if(lval_type(keep) == LVAL_ERR) { return keep; }
+      lval* err = lval_err("Function 'filter' predicate returned %s, Expected %s.", ltype_name(lval_type(keep)), ltype_name(LVAL_NUM));
+      lval_del(keep);
+      return err;
+    }
 
-  for (int i = 0; i < e->count; i++) {
-    /* if found, delete and overwrite */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
+    /* What is kept is the element as written, not its value */
+    if(lval_truthy(keep)) {
+      result->cell[result->count++] = lval_ref(l->cell[i]);
     }
- 
+    lval_del(keep);
   }
+  lval_del(a);
+  return result;
+}
 
-  /* If nothing found, create new. */
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-
-  /* Copy conetnts into a new location */
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
-  
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* z = lval_ref(a->cell[1]);
+  for (int i = 0; i < l->count && lval_type(z) != LVAL_ERR; i++) {
+    lval* x = lval_eval(e, lval_ref(l->cell[i]));
+    lval* y = lval_type(x) == LVAL_ERR ? lval_ref(x) : lval_call2(e, f, z, x);
+    lval_del(x); lval_del(z);
+    z = y;
+  }
+  lval_del(a);
+  return z;
 }
 
-void lenv_def(lenv* env, lval* name, lval* value) {
-  //Search a parent until we get to the parent environment
-  if (env->parent) {
-    lenv_def(env->parent, name, value);
+/* Vector builtins */
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval* l = a->cell[0];
+  int dbl = 0;
+  for (int i = 0; i < l->count; i++) {
+    int t = lval_type(l->cell[i]);
+    LASSERT(a, t == LVAL_NUM || t == LVAL_DBL, "Function 'vec' passed %s, Expected %s or %s.", ltype_name(t), ltype_name(LVAL_NUM), ltype_name(LVAL_DBL));
+    if(t == LVAL_DBL) { dbl = 1; }
+  }
 
+  lvec* v = lvec_new(dbl, l->count);
+  for (int i = 0; i < l->count; i++) {
+    if(dbl) { v->d[i] = lval_to_double(l->cell[i]); } else { v->l[i] = lval_to_long(l->cell[i]); }
   }
-  
-  lenv_put(env, name, value);
-  
+  lval_del(a);
+  return lval_vec(v);
 }
 
-lval* lval_join(lval* x, lval* y) {
+lval* builtin_vec_list(lenv* e, lval* a) {
+  LASSERT_NUM("vec-list", a, 1);
+  LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
 
-  /* For each cell in 'y' add it to 'x' */
-  while(y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  lvec* v = a->cell[0]->vec;
+  lval* l = lval_cells(lval_qexpr(), v->count);
+  for (int i = 0; i < v->count; i++) {
+    l->cell[i] = v->dbl ? lval_dbl(v->d[i]) : lval_num(v->l[i]);
   }
-
-  /* Delete the empty 'y' and return 'x' */
-  lval_del(y);
-  return x;
+  lval_del(a);
+  return l;
 }
 
-lval* lval_pop(lval* v, int i) {
-  lval* x = v->cell[i];
-	 
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
- 
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
- 
+lval* builtin_vec_sum(lenv* e, lval* a) {
+  LASSERT_NUM("vec-sum", a, 1);
+  LASSERT_TYPE("vec-sum", a, 0, LVAL_VEC);
+
+  lvec* v = a->cell[0]->vec;
+  lval* x;
+  long sum;
+  if(v->dbl) {
+    x = lval_dbl(vec_sum_dbl(v->d, v->count));
+  } else if(vec_sum_long(v->l, v->count, &sum)) {
+    x = lval_num(sum);
+  } else {
+    /* Overflowed somewhere, redo it exactly */
+    x = lval_num(0);
+    for (int i = 0; i < v->count; i++) {
+      lval* y = lval_num(v->l[i]);
+      lval* s = lval_num_add(x, y);
+      lval_del(x); lval_del(y);
+      x = s;
+    }
+  }
+  lval_del(a);
   return x;
 }
-	 
-lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
-  lval_del(v);
+
+lval* builtin_vec_dot(lenv* e, lval* a) {
+  LASSERT_NUM("vec-dot", a, 2);
+  LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+
+  lvec* v = a->cell[0]->vec;
+  lvec* w = a->cell[1]->vec;
+  LASSERT(a, v->count == w->count, "Function 'vec-dot' passed vectors of length %i and %i", v->count, w->count);
+
+  lval* x;
+  long dot;
+  if(v->dbl || w->dbl) {
+    lvec* dv = lvec_to_dbl(v);
+    lvec* dw = lvec_to_dbl(w);
+    x = lval_dbl(vec_dot_dbl(dv->d, dw->d, v->count));
+    if(dv != v) { free(dv); }
+    if(dw != w) { free(dw); }
+  } else if(vec_dot_long(v->l, w->l, v->count, &dot)) {
+    x = lval_num(dot);
+  } else {
+    x = lval_num(0);
+    for (int i = 0; i < v->count; i++) {
+      lval* vi = lval_num(v->l[i]);
+      lval* wi = lval_num(w->l[i]);
+      lval* p = lval_num_mul(vi, wi);
+      lval* s = lval_num_add(x, p);
+      lval_del(x); lval_del(p); lval_del(vi); lval_del(wi);
+      x = s;
+    }
+  }
+  lval_del(a);
   return x;
 }
 
+lval* builtin_vec_extreme(lenv* e, lval* a, char* name, int max) {
+  LASSERT_NUM(name, a, 1);
+  LASSERT_TYPE(name, a, 0, LVAL_VEC);
+  lvec* v = a->cell[0]->vec;
+  LASSERT(a, v->count != 0, "Function %s passed an empty vector", name);
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-	 
-  for(int i = 0; i < a->count; i++) {
-    if(a->cell[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-number!");
+  lval* x;
+  if(v->dbl) {
+    x = lval_dbl(vec_min_dbl(v->d, v->count, max));
+  } else {
+    long m = v->l[0];
+    for (int i = 1; i < v->count; i++) {
+      m = max ? (v->l[i] > m ? v->l[i] : m) : (v->l[i] < m ? v->l[i] : m);
     }
+    x = lval_num(m);
   }
-	 
-  lval* x = lval_pop(a, 0);
-	 
-  if((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num =-x->num;
-  }
-		 
-  while(a->count > 0) {
-    lval* y = lval_pop(a, 0);
-    if (strcmp(op, "+") == 0) { x->num += y->num; } 
-    if (strcmp(op, "-") == 0) { x->num -= y->num; } 
-    if (strcmp(op, "*") == 0) { x->num *= y->num; } 
-    if (strcmp(op, "/") == 0) { 
-      if(y->num == 0) {
-	lval_del(x); lval_del(y);
-	x = lval_err("Division by cero"); break;
-      }
-      x->num /= y->num;
-    }	 
-    lval_del(y);
-  }
-	 
   lval_del(a);
   return x;
 }
-	 
 
-lval* builtin_head(lenv* e, lval* qexpr) {
-  LASSERT(qexpr, qexpr->count == 1 , "Function 'head' passed too many arguments. Got %i, Expected %i", qexpr->count, 1);
-  LASSERT(qexpr, qexpr->cell[0]->type == LVAL_QEXPR , "Function 'head' passed incorrect type!, Got %s, Expected %s.", ltype_name(qexpr->cell[0]->type), ltype_name(LVAL_QEXPR));
-  LASSERT(qexpr, qexpr->cell[0]->count != 0 , "Function 'head' passed {}");
+lval* builtin_vec_min(lenv* e, lval* a) { return builtin_vec_extreme(e, a, "vec-min", 0); }
+lval* builtin_vec_max(lenv* e, lval* a) { return builtin_vec_extreme(e, a, "vec-max", 1); }
 
-  //Take first argument
-  lval* firstQexpr = lval_take(qexpr, 0);
-  //Delete everything until theres only the first one
-  while(firstQexpr->count > 1) {
-    lval_del(lval_pop(firstQexpr, 1));
+/* Elementwise, of two vectors of the same length or a vector and a
+   number applied to every element */
+lval* builtin_vec_op(lenv* e, lval* a, char* name, int mul) {
+  LASSERT_NUM(name, a, 2);
+  LASSERT_TYPE(name, a, 0, LVAL_VEC);
+
+  lvec* v = a->cell[0]->vec;
+  lval* y = a->cell[1];
+  int t = lval_type(y);
+  LASSERT(a, t == LVAL_VEC || t == LVAL_NUM || t == LVAL_DBL, "Function %s passed incorrect type!, Got %s, Expected %s.", name, ltype_name(t), ltype_name(LVAL_VEC));
+
+  lvec* w;
+  if(t == LVAL_VEC) {
+    w = y->vec;
+    LASSERT(a, v->count == w->count, "Function %s passed vectors of length %i and %i", name, v->count, w->count);
+  } else {
+    w = lvec_new(t == LVAL_DBL, v->count);
+    for (int i = 0; i < v->count; i++) {
+      if(w->dbl) { w->d[i] = y->dbl; } else { w->l[i] = lval_to_long(y); }
+    }
+  }
+
+  lvec* r;
+  if(v->dbl || w->dbl) {
+    lvec* dv = lvec_to_dbl(v);
+    lvec* dw = lvec_to_dbl(w);
+    r = lvec_new(1, v->count);
+    vec_op_dbl(r->d, dv->d, dw->d, v->count, mul);
+    if(dv != v) { free(dv); }
+    if(dw != w) { free(dw); }
+  } else {
+    r = lvec_new(0, v->count);
+    int ok = mul ? vec_mul_long(r->l, v->l, w->l, v->count) : vec_add_long(r->l, v->l, w->l, v->count);
+    if(!ok) {
+      free(r);
+      r = NULL;
+    }
   }
-  return firstQexpr;
+  if(t != LVAL_VEC) { free(w); }
+  lval_del(a);
+  return r ? lval_vec(r) : lval_err("Function %s overflowed, use a vector of floats", name);
 }
 
-	 
-lval* builtin_tail(lenv* e, lval* qexpr) {
-  LASSERT(qexpr, qexpr->count == 1 , "Function 'tail' passed too many arguments Got %i, Expected %i", qexpr->count, 1);
-  LASSERT(qexpr, qexpr->cell[0]->type == LVAL_QEXPR , "Function 'tail' passed incorrect type! Got %s, Expected %s.", ltype_name(qexpr->cell[0]->type), ltype_name(LVAL_QEXPR));
-  LASSERT(qexpr, qexpr->cell[0]->count != 0 , "Function 'tail' passed {}");
-  //Take first argument
-  lval* firstQexpr = lval_take(qexpr, 0);
+lval* builtin_vec_add(lenv* e, lval* a) { return builtin_vec_op(e, a, "vec+", 0); }
+lval* builtin_vec_mul(lenv* e, lval* a) { return builtin_vec_op(e, a, "vec*", 1); }
 
-  //Delete only the first element
-  lval_del(lval_pop(firstQexpr, 0));
-  return firstQexpr;
-}
+lval* builtin_vec_map(lenv* e, lval* a) {
+  LASSERT_NUM("vec-map", a, 2);
+  LASSERT_TYPE("vec-map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("vec-map", a, 1, LVAL_VEC);
 
+  lval* f = a->cell[0];
+  lvec* v = a->cell[1]->vec;
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+  /* Results are boxed until they are all in, then packed like 'vec' */
+  lval* results = lval_cells(lval_qexpr(), v->count);
+  results->count = 0;
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->dbl ? lval_dbl(v->d[i]) : lval_num(v->l[i]);
+    lval* y = lval_call2(e, f, x, NULL);
+    lval_del(x);
+    if(lval_type(y) == LVAL_ERR) { lval_del(results); lval_del(a); return y; }
+    results->cell[results->count++] = y;
+  }
+  lval_del(a);
+  return builtin_vec(e, lval_add(lval_sexpr(), results));
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  LASSERT(a, a->count == 1, "Function, 'eval' passed too many arguments! Got %i, Expected %i", a->count, 1);
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'eval' passed incorrect type! Got %s, Expected %s.", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+/* Map builtins. Maps are values like any other, 'map-put' and 'map-del'
+   return the changed map and only change it in place when nothing else
+   holds it. 'assoc' and 'dissoc' return a new persistent map sharing
+   most of the old one. Reading works the same on both kinds. */
+#define LASSERT_KEY(parameter, lval, position) \
+  LASSERT(lval, lmap_key_ok(lval->cell[position]), "Function %s passed %s as a key, Expected a Number, String or Symbol.", parameter, ltype_name(lval_type(lval->cell[position])));
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
-}
+#define LASSERT_MAP(parameter, lval, position) \
+  LASSERT(lval, lval_is_map(lval->cell[position]), "Function %s passed incorrect type!, Got %s, Expected %s.", parameter, ltype_name(lval_type(lval->cell[position])), ltype_name(LVAL_MAP));
 
-lval* lval_call(lenv* env, lval* fun, lval* values) {
-  if(fun->builtin) {
-    return fun->builtin(env, values);
-  }
+lval* builtin_map_of(lenv* e, lval* a) {
+  LASSERT_NUM("map-of", a, 1);
+  LASSERT_TYPE("map-of", a, 0, LVAL_QEXPR);
 
-  int total = fun->formals->count;
-  int given = values->count;
+  lval* l = a->cell[0];
+  LASSERT(a, l->count % 2 == 0, "Function 'map-of' passed %i elements, Expected keys and values in pairs.", l->count);
+  for (int i = 0; i < l->count; i += 2) {
+    LASSERT_KEY("map-of", l, i);
+  }
 
-   while(values->count) {
+  lmap* m = lmap_new();
+  for (int i = 0; i < l->count; i += 2) {
+    lmap_put(m, lval_ref(l->cell[i]), lval_ref(l->cell[i+1]));
+  }
+  lval_del(a);
+  return lval_map(m);
+}
 
-    if(fun->formals->count == 0) {
-      lval_del(values); return lval_err("function passed too many arguments, expected %i, got %i", given, total);
-    }
+lval* builtin_map_get(lenv* e, lval* a) {
+  LASSERT_NUM("map-get", a, 2);
+  LASSERT_MAP("map-get", a, 0);
+  LASSERT_KEY("map-get", a, 1);
 
-    lval* sym = lval_pop(fun->formals, 0);
+  lval* x = lval_map_get(a->cell[0], a->cell[1]);
+  LASSERT(a, x, "Key not found in map!");
+  x = lval_ref(x);
+  lval_del(a);
+  return x;
+}
 
-    if(strcmp(sym->sym, "&") == 0) {
+lval* builtin_map_put(lenv* e, lval* a) {
+  LASSERT_NUM("map-put", a, 3);
+  LASSERT_TYPE("map-put", a, 0, LVAL_MAP);
+  LASSERT_KEY("map-put", a, 1);
 
-      if(fun->formals->count != 1) {
-        lval_del(values);
-        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-      }
+  lval* m = lval_own(lval_pop(a, 0));
+  lmap_put(m->map, lval_ref(a->cell[0]), lval_ref(a->cell[1]));
+  lval_del(a);
+  return m;
+}
 
-      lval* nsym = lval_pop(fun->formals, 0);
-      lenv_put(fun->env, nsym, builtin_list(env, values));
-      lval_del(sym); lval_del(nsym);
-      break;
-    }
+lval* builtin_map_del(lenv* e, lval* a) {
+  LASSERT_NUM("map-del", a, 2);
+  LASSERT_TYPE("map-del", a, 0, LVAL_MAP);
+  LASSERT_KEY("map-del", a, 1);
+
+  lval* m = a->cell[0];
+  lval* k = a->cell[1];
+  /* Nothing to copy if the key is not there */
+  if(lmap_find(m->map, k, lmap_hash(k)) < 0) {
+    m = lval_ref(m);
+    lval_del(a);
+    return m;
+  }
+  m = lval_own(lval_pop(a, 0));
+  lmap_del(m->map, a->cell[0]);
+  lval_del(a);
+  return m;
+}
 
-    lval* value = lval_pop(values, 0);
+lval* builtin_map_keys(lenv* e, lval* a) {
+  LASSERT_NUM("map-keys", a, 1);
+  LASSERT_MAP("map-keys", a, 0);
 
-    lenv_put(fun->env, sym, value);
+  int count;
+  lval** kv = lval_map_entries(a->cell[0], &count);
+  lval* keys = lval_cells(lval_qexpr(), count / 2);
+  for (int i = 0; i < count; i += 2) { keys->cell[i/2] = lval_ref(kv[i]); }
+  free(kv);
+  lval_del(a);
+  return keys;
+}
 
-    lval_del(sym); lval_del(value);
+/* (map-fold f z m) calls (f acc key value) for every binding in turn */
+lval* builtin_map_fold(lenv* e, lval* a) {
+  LASSERT_NUM("map-fold", a, 3);
+  LASSERT_TYPE("map-fold", a, 0, LVAL_FUN);
+  LASSERT_MAP("map-fold", a, 2);
 
+  /* 'a' holds the map, so the entries stay alive whatever 'f' does */
+  int count;
+  lval** kv = lval_map_entries(a->cell[2], &count);
+  lval* f = a->cell[0];
+  lval* z = lval_ref(a->cell[1]);
+  for (int i = 0; i < count && lval_type(z) != LVAL_ERR; i += 2) {
+    lval* values[4] = { lval_ref(f), z, lval_ref(kv[i]), lval_ref(kv[i+1]) };
+    z = vm_apply(e, values, 4);
   }
+  free(kv);
+  lval_del(a);
+  return z;
+}
 
-  lval_del(values);
+lval* builtin_hamt(lenv* e, lval* a) {
+  LASSERT_NUM("hamt", a, 1);
+  LASSERT_TYPE("hamt", a, 0, LVAL_QEXPR);
 
-  if(fun->formals->count > 0 && strcmp(fun->formals->cell[0]->sym, "&") == 0) {
+  lval* l = a->cell[0];
+  LASSERT(a, l->count % 2 == 0, "Function 'hamt' passed %i elements, Expected keys and values in pairs.", l->count);
+  for (int i = 0; i < l->count; i += 2) {
+    LASSERT_KEY("hamt", l, i);
+  }
 
-    if(fun->formals->count != 2) {
-      lval_err("Funtion format invalid '&' not followed by single symbol.");
-    }
+  lhnode* trie = hnode_new(0, 0);
+  int count = 0;
+  for (int i = 0; i < l->count; i += 2) {
+    int added = 0;
+    lhnode* next = hnode_assoc(trie, lval_ref(l->cell[i]), lval_ref(l->cell[i+1]), lmap_hash(l->cell[i]), 0, &added);
+    hnode_del(trie);
+    trie = next;
+    count += added;
+  }
+  lval_del(a);
+  return lval_hamt(trie, count);
+}
 
-    lval_del(lval_pop(fun->formals, 0));
+lval* builtin_assoc(lenv* e, lval* a) {
+  LASSERT_NUM("assoc", a, 3);
+  LASSERT_TYPE("assoc", a, 0, LVAL_HAMT);
+  LASSERT_KEY("assoc", a, 1);
 
-    lval* sym = lval_pop(fun->formals, 0);
-    lval* val = lval_qexpr();
+  lval* m = a->cell[0];
+  int added = 0;
+  lhnode* trie = hnode_assoc(m->trie, lval_ref(a->cell[1]), lval_ref(a->cell[2]), lmap_hash(a->cell[1]), 0, &added);
+  lval* x = lval_hamt(trie, m->trie_count + added);
+  lval_del(a);
+  return x;
+}
 
-    lenv_put(fun->env, sym, val);
-    lval_del(sym); lval_del(val);
+lval* builtin_dissoc(lenv* e, lval* a) {
+  LASSERT_NUM("dissoc", a, 2);
+  LASSERT_TYPE("dissoc", a, 0, LVAL_HAMT);
+  LASSERT_KEY("dissoc", a, 1);
 
-  }
+  lval* m = a->cell[0];
+  lhnode* trie = hnode_dissoc(m->trie, a->cell[1], lmap_hash(a->cell[1]), 0);
+  lval* x = trie ? lval_hamt(trie, m->trie_count - 1) : lval_ref(m);
+  lval_del(a);
+  return x;
+}
 
-  if(fun->formals->count == 0) {
+/* String builtins */
+lval* builtin_str_len(lenv* e, lval* a) {
+  LASSERT_NUM("str-len", a, 1);
+  LASSERT_TYPE("str-len", a, 0, LVAL_STR);
 
-    fun->env->parent = env;
+  long n = a->cell[0]->len;
+  lval_del(a);
+  return lval_num(n);
+}
 
-    return builtin_eval(fun->env, lval_add(lval_sexpr(), lval_copy(fun->body)));
-  } else {
-    return lval_copy(fun);
+lval* builtin_str_concat(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("str-concat", a, i, LVAL_STR);
   }
-  
-  
+  LASSERT(a, a->count > 0, "Function 'str-concat' passed no arguments!");
+  long len = 0;
+  for (int i = 0; i < a->count; i++) { len += a->cell[i]->len; }
+  LASSERT(a, len <= INT_MAX, "Function 'str-concat' would build a string of %li characters!", len);
+
+  lval* x = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) { x = lval_rope(x, lval_ref(a->cell[i])); }
+  lval_del(a);
+  return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-		 
-  for (int i=0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
-		 
-  for (int i=0; i < v->count; i++) {
-    if(v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-  }
-		
-  if (v->count == 0) { return v; }
-		
-  if (v->count == 1) { return lval_take(v,0); }
+/* (substr s start n), the 'n' characters of 's' from 'start' */
+lval* builtin_substr(lenv* e, lval* a) {
+  LASSERT_NUM("substr", a, 3);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+  LASSERT_TYPE("substr", a, 2, LVAL_NUM);
 
-  /* ensure first element is a function. */
-  lval* f = lval_pop(v, 0);
-  if(f->type != LVAL_FUN) {
-    lval_del(v); lval_del(f);
-    return lval_err("S-expression does not start with symbol!");
-  }
+  lval* s = a->cell[0];
+  long start = lval_to_long(a->cell[1]);
+  long n = lval_to_long(a->cell[2]);
+  LASSERT(a, start >= 0 && n >= 0 && start <= s->len && n <= s->len - start,
+          "Function 'substr' passed range %li to %li of a string of %i", start, start + n, s->len);
 
-  lval* result = lval_call(e, f, v);
-  return result;
+  lval* x = lval_strn(lval_str_chars(s) + start, n);
+  lval_del(a);
+  return x;
 }
 
-
-lval* lval_eval(lenv* e,lval* v) {
-  if(v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* (str-join sep {s ...}) in one allocation, the length is known upfront */
+lval* builtin_str_join(lenv* e, lval* a) {
+  LASSERT_NUM("str-join", a, 2);
+  LASSERT_TYPE("str-join", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-join", a, 1, LVAL_QEXPR);
+
+  lval* sep = a->cell[0];
+  lval* l = a->cell[1];
+  long len = 0;
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, lval_type(l->cell[i]) == LVAL_STR, "Function 'str-join' passed %s in the list, Expected %s.", ltype_name(lval_type(l->cell[i])), ltype_name(LVAL_STR));
+    len += l->cell[i]->len + (i ? sep->len : 0);
   }
-  if(v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  return v;
+  LASSERT(a, len <= INT_MAX, "Function 'str-join' would build a string of %li characters!", len);
+
+  lval* x = lval_new(LVAL_STR);
+  x->str = lval_text(x, len);
+  x->len = len;
+  x->hash = 0;
+  char* end = x->str;
+  for (int i = 0; i < l->count; i++) {
+    if(i) { memcpy(end, lval_str_chars(sep), sep->len); end += sep->len; }
+    memcpy(end, lval_str_chars(l->cell[i]), l->cell[i]->len);
+    end += l->cell[i]->len;
+  }
+  *end = '\0';
+  lval_del(a);
+  return x;
 }
 
+/* Arithmetic. Each operator folds over the arguments where they are, in
+   longs until something overflows into a bignum, or all in doubles if any
+   of them is a float. Two fixnums (nearly every call) skip the checks and
+   the loop. */
+lval* builtin_add(lenv* e, lval* a) {
+  if(a->count == 2 && LVAL_IS_FIXNUM(a->cell[0]) && LVAL_IS_FIXNUM(a->cell[1])) {
+    long x = lval_to_long(a->cell[0]) + lval_to_long(a->cell[1]);
+    lval_del(a);
+    return lval_num(x);
+  }
+  LASSERT_ALL_NUM(a);
 
+  if(lval_any_dbl(a->cell, a->count)) {
+    double x = dbl_reduce(a->cell, a->count, 0);
+    lval_del(a);
+    return lval_dbl(x);
+  }
 
-lval* builtin_join(lenv* e, lval* a) {
-
-  for (int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type Got %s, Expected %s.", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+  lval* x = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    lval* y = lval_num_add(x, a->cell[i]);
+    lval_del(x);
+    x = y;
   }
+  lval_del(a);
+  return x;
+}
 
-  lval* x = lval_pop(a, 0);
+lval* builtin_sub(lenv* e, lval* a) {
+  if(a->count == 2 && LVAL_IS_FIXNUM(a->cell[0]) && LVAL_IS_FIXNUM(a->cell[1])) {
+    long x = lval_to_long(a->cell[0]) - lval_to_long(a->cell[1]);
+    lval_del(a);
+    return lval_num(x);
+  }
+  LASSERT_ALL_NUM(a);
 
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+  if(lval_any_dbl(a->cell, a->count)) {
+    double x = lval_to_double(a->cell[0]);
+    x = a->count == 1 ? -x : x - dbl_reduce(a->cell + 1, a->count - 1, 0);
+    lval_del(a);
+    return lval_dbl(x);
   }
 
+  lval* x = lval_ref(a->cell[0]);
+  if(a->count == 1) {
+    lval* y = lval_num_sub(lval_num(0), x);
+    lval_del(x);
+    x = y;
+  }
+  for (int i = 1; i < a->count; i++) {
+    lval* y = lval_num_sub(x, a->cell[i]);
+    lval_del(x);
+    x = y;
+  }
   lval_del(a);
   return x;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
-}
-
 lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
-}
+  long x;
+  if(a->count == 2 && LVAL_IS_FIXNUM(a->cell[0]) && LVAL_IS_FIXNUM(a->cell[1])
+     && !__builtin_mul_overflow(lval_to_long(a->cell[0]), lval_to_long(a->cell[1]), &x)) {
+    lval_del(a);
+    return lval_num(x);
+  }
+  LASSERT_ALL_NUM(a);
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+  if(lval_any_dbl(a->cell, a->count)) {
+    double x = dbl_reduce(a->cell, a->count, 1);
+    lval_del(a);
+    return lval_dbl(x);
+  }
+
+  lval* p = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    lval* y = lval_num_mul(p, a->cell[i]);
+    lval_del(p);
+    p = y;
+  }
+  lval_del(a);
+  return p;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+lval* builtin_div(lenv* e, lval* a) {
+  LASSERT_ALL_NUM(a);
+
+  lval* x = lval_ref(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    lval* d = a->cell[i];
+    if((lval_type(d) == LVAL_NUM || lval_type(d) == LVAL_DBL) && lval_to_double(d) == 0) {
+      lval_del(x);
+      lval_del(a);
+      return lval_err("Division by cero");
+    }
+    lval* y = lval_num_div(x, d);
+    lval_del(x);
+    x = y;
+  }
+  lval_del(a);
+  return x;
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
@@ -687,7 +3864,7 @@ lval* builtin_var(lenv* env, lval* a, char* func) {
 
   //Ensure all elements of first list are symbols
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM, "Function 'def' cannot define non symbols");
+    LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM, "Function 'def' cannot define non symbols");
   }
 
 
@@ -721,77 +3898,105 @@ lval* builtin_lambda(lenv* env, lval* val) {
   LASSERT_TYPE("\\", val, 1, LVAL_QEXPR);
 
   for(int i=0; i < val->cell[0]->count; i++) {
-    int formalsType =  val->cell[0]->cell[i]->type;
+    int formalsType =  lval_type(val->cell[0]->cell[i]);
     LASSERT(val, formalsType == LVAL_SYM, "Cannot pass non symbol characters, got %s, expected %s", ltype_name(formalsType), ltype_name(LVAL_SYM));
   }
 
+  /* Checked here rather than on every call */
+  lval* f = val->cell[0];
+  for (int i = 0; i < f->count; i++) {
+    LASSERT(val, f->cell[i]->sym != lsym_rest || i == f->count - 2,
+            "Function format invalid. Symbol '&' not followed by single symbol.");
+  }
+
   lval* formals =  lval_pop(val, 0);
   lval* body =  lval_pop(val, 0);
   lval_del(val);
-  return lval_lambda(formals, body);
-}
-
-lval* builtin_ord(lenv* env, lval* values, char* operator) {
-  LASSERT_NUM(operator, values, 2);
-  LASSERT_TYPE(operator, values, 0, LVAL_NUM);
-  LASSERT_TYPE(operator, values, 1, LVAL_NUM);
 
-  lval* first = lval_pop(values, 0);
-  lval* second = lval_pop(values, 0);
-  lval_del(values);
-
-  lval* result;
-  if(strcmp("<", operator) == 0) {
-      result = lval_num(first->num < second->num);
-  } else if(strcmp(">", operator) == 0) {
-      result = lval_num(first->num > second->num);
-  } else if(strcmp(">=", operator) == 0) {
-      result =  lval_num(first->num >= second->num);
-  } else if(strcmp("<=", operator) == 0) {
-      result = lval_num(first->num <= second->num);
-  }
-
-  lval_del(first); lval_del(second);
-  return result;
+  /* Resolve the formals in the body now, calls find the code ready */
+  lval* fun = lval_lambda(formals, body);
+  fun->code = lcode_compile(fun->body, fun->formals);
+  return fun;
 }
 
+/* Orderings compare the arguments in place, of either size */
 lval* builtin_lt(lenv* env, lval* values) {
-  return builtin_ord(env, values, "<");
-
+  LASSERT_NUM("<", values, 2);
+  LASSERT_NUMBER("<", values, 0);
+  LASSERT_NUMBER("<", values, 1);
+  long x = lval_num_cmp(values->cell[0], values->cell[1]) < 0;
+  lval_del(values);
+  return lval_num(x);
 }
 
 lval* builtin_gt(lenv* env, lval* values) {
-  return builtin_ord(env, values, ">");
-
+  LASSERT_NUM(">", values, 2);
+  LASSERT_NUMBER(">", values, 0);
+  LASSERT_NUMBER(">", values, 1);
+  long x = lval_num_cmp(values->cell[0], values->cell[1]) > 0;
+  lval_del(values);
+  return lval_num(x);
 }
 
 lval* builtin_gte(lenv* env, lval* values) {
-  return builtin_ord(env, values, ">=");
-
+  LASSERT_NUM(">=", values, 2);
+  LASSERT_NUMBER(">=", values, 0);
+  LASSERT_NUMBER(">=", values, 1);
+  long x = lval_num_cmp(values->cell[0], values->cell[1]) >= 0;
+  lval_del(values);
+  return lval_num(x);
 }
 
 lval* builtin_lte(lenv* env, lval* values) {
-  return builtin_ord(env, values, "<=");
+  LASSERT_NUM("<=", values, 2);
+  LASSERT_NUMBER("<=", values, 0);
+  LASSERT_NUMBER("<=", values, 1);
+  long x = lval_num_cmp(values->cell[0], values->cell[1]) <= 0;
+  lval_del(values);
+  return lval_num(x);
 }
 
 int lval_eq(lval* first, lval* second) {
-  if(first->type != second->type) { return 0; }
-  switch(first->type) {
-  case LVAL_NUM: return first->num == second->num; break;
-  case LVAL_SYM: return strcmp(first->sym, second->sym) == 0; break;
-  case LVAL_STR: return strcmp(first->str, second->str) == 0; break;
+  /* Integers and floats compare by value */
+  if(lval_is_num(first) && lval_is_num(second)) {
+    return lval_num_cmp(first, second) == 0;
+  }
+  /* Maps of either kind compare by their bindings, wherever they sit in
+     the tables */
+  if(lval_is_map(first) && lval_is_map(second)) {
+    if(lval_map_count(first) != lval_map_count(second)) { return 0; }
+    int count;
+    lval** kv = lval_map_entries(first, &count);
+    int eq = 1;
+    for (int i = 0; i < count && eq; i += 2) {
+      lval* y = lval_map_get(second, kv[i]);
+      eq = y && lval_eq(kv[i+1], y);
+    }
+    free(kv);
+    return eq;
+  }
+  if(lval_type(first) != lval_type(second)) { return 0; }
+  switch(lval_type(first)) {
+  case LVAL_SYM: return first->sym == second->sym; break;
+  case LVAL_VEC:
+    return first->vec->dbl == second->vec->dbl && first->vec->count == second->vec->count
+      && memcmp(first->vec->l, second->vec->l, sizeof(lvec_elem) * first->vec->count) == 0;
+  case LVAL_STR: return lval_str_eq(first, second); break;
   case LVAL_ERR: return strcmp(first->err, second->err) == 0; break;
   case LVAL_FUN:
     if(first->builtin || second->builtin) {
       return first->builtin == second->builtin;
     } else {
+      int n = first->bound ? first->bound->count : 0;
+      if(n != (second->bound ? second->bound->count : 0)) { return 0; }
+      if(n && !lval_eq(first->bound, second->bound)) { return 0; }
       return lval_eq(first->formals, second->formals) && lval_eq(first->body, second->body);
     }
   case LVAL_QEXPR:
   case LVAL_SEXPR:
     if(first->count != second->count) { return 0; }
     for(int i = 0; i < first->count; i++) {
-      if(lval_eq(first->cell[i], second->cell[i])) { return 0; }
+      if(!lval_eq(first->cell[i], second->cell[i])) { return 0; }
     }
     return 1;
     break;
@@ -801,52 +4006,31 @@ int lval_eq(lval* first, lval* second) {
 }
 
 
-lval* builtin_compare(lenv* env, lval* values, char* operator) {
-  LASSERT_NUM(operator, values, 2);
-
-  lval* first = lval_pop(values, 0);
-  lval* second = lval_pop(values, 0);
-  lval_del(values);
-
-  lval* result;
-
-  if(strcmp("==", operator) == 0) {
-    result = lval_num(lval_eq(first, second));
-  } else if(strcmp("!=", operator) == 0) {
-    result = lval_num(!lval_eq(first, second));
-  }
-
-  lval_del(first); lval_del(second);
-  return result;
-}
-
 lval* builtin_eq(lenv* env, lval* values) {
-  return builtin_compare(env, values, "==");
+  LASSERT_NUM("==", values, 2);
+  long x = lval_eq(values->cell[0], values->cell[1]);
+  lval_del(values);
+  return lval_num(x);
 }
 
 lval* builtin_neq(lenv* env, lval* values) {
-  return builtin_compare(env, values, "!=");
+  LASSERT_NUM("!=", values, 2);
+  long x = !lval_eq(values->cell[0], values->cell[1]);
+  lval_del(values);
+  return lval_num(x);
 }
 
 lval* builtin_if(lenv* env, lval* values) {
   LASSERT_NUM("if", values, 3);
-  LASSERT_TYPE("if", values, 0, LVAL_NUM);
+  LASSERT_NUMBER("if", values, 0);
   LASSERT_TYPE("if", values, 1, LVAL_QEXPR);
   LASSERT_TYPE("if", values, 2, LVAL_QEXPR);
 
-  int condition = values->cell[0]->num;
-  lval* ifStatement = values->cell[1];
-  lval* elseStatement = values->cell[2];
+  int condition = lval_truthy(values->cell[0]);
 
-  ifStatement->type = LVAL_SEXPR;
-  elseStatement->type = LVAL_SEXPR;
-
-  lval* result;
-  if(condition) {
-    result = lval_eval(env, lval_pop(values, 1));
-  } else {
-    result = lval_eval(env, lval_pop(values, 2));
-  }
+  lval* statement = lval_pop(values, condition ? 1 : 2);
+  lval* result = lval_eval_expr(env, statement);
+  lval_del(statement);
 
   lval_del(values);
   return result;
@@ -857,18 +4041,25 @@ lval* builtin_load(lenv* env, lval* filename) {
   LASSERT_TYPE("load", filename, 0, LVAL_STR);
 
   mpc_result_t r;
-  if (mpc_parse_contents(filename->cell[0]->str, Galisp, &r)) {
+  if (mpc_parse_contents(lval_str_chars(filename->cell[0]), Galisp, &r)) {
     lval* expr = lval_read(r.output);
     mpc_ast_delete(r.output);
 
+    /* The rest of the file is live while each expression runs */
+    gc_root_push(filename);
+    gc_root_push(expr);
+
     while(expr->count) {
       lval* eval = lval_eval(env, lval_pop(expr, 0));
-      if(eval->type == LVAL_ERR) {
+      if(lval_type(eval) == LVAL_ERR) {
 	lval_println(eval);
       }
       lval_del(eval);
+      gc_safepoint();
     }
 
+    gc_root_pop();
+    gc_root_pop();
     lval_del(expr);
     lval_del(filename);
     return lval_sexpr();
@@ -897,11 +4088,24 @@ lval* builtin_print(lenv* env, lval* values) {
   return lval_sexpr();
 }
 
+/* (gc 1) asks for a collection at the next safe point, (gc 0) does not.
+   Both print the collector statistics as they are now. */
+lval* builtin_gc(lenv* env, lval* values) {
+  LASSERT_NUM("gc", values, 1);
+  LASSERT_TYPE("gc", values, 0, LVAL_NUM);
+
+  if(lval_to_long(values->cell[0])) { gc.requested = 1; }
+  gc_print_stats();
+  lval_del(values);
+
+  return lval_sexpr();
+}
+
 lval* builtin_error(lenv* env, lval* values) {
   LASSERT_NUM("error", values, 1);
   LASSERT_TYPE("error", values, 0, LVAL_STR);
 
-  lval* err = lval_err(values->cell[0]->str);
+  lval* err = lval_err(lval_str_chars(values->cell[0]));
   lval_del(values);
 
   return err;
@@ -913,6 +4117,37 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "last", builtin_last);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "drop", builtin_drop);
+  lenv_add_builtin(e, "elem", builtin_elem);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "vec-list", builtin_vec_list);
+  lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+  lenv_add_builtin(e, "vec-dot", builtin_vec_dot);
+  lenv_add_builtin(e, "vec-min", builtin_vec_min);
+  lenv_add_builtin(e, "vec-max", builtin_vec_max);
+  lenv_add_builtin(e, "vec+", builtin_vec_add);
+  lenv_add_builtin(e, "vec*", builtin_vec_mul);
+  lenv_add_builtin(e, "vec-map", builtin_vec_map);
+  lenv_add_builtin(e, "map-of", builtin_map_of);
+  lenv_add_builtin(e, "map-get", builtin_map_get);
+  lenv_add_builtin(e, "map-put", builtin_map_put);
+  lenv_add_builtin(e, "map-del", builtin_map_del);
+  lenv_add_builtin(e, "map-keys", builtin_map_keys);
+  lenv_add_builtin(e, "map-fold", builtin_map_fold);
+  lenv_add_builtin(e, "hamt", builtin_hamt);
+  lenv_add_builtin(e, "assoc", builtin_assoc);
+  lenv_add_builtin(e, "dissoc", builtin_dissoc);
+  lenv_add_builtin(e, "str-len", builtin_str_len);
+  lenv_add_builtin(e, "str-concat", builtin_str_concat);
+  lenv_add_builtin(e, "substr", builtin_substr);
+  lenv_add_builtin(e, "str-join", builtin_str_join);
   lenv_add_builtin(e, "+", builtin_add);
   lenv_add_builtin(e, "-", builtin_sub);
   lenv_add_builtin(e, "*", builtin_mul);
@@ -930,6 +4165,7 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "load", builtin_load);
   lenv_add_builtin(e, "print", builtin_print);
   lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "gc", builtin_gc);
 }
 
 
@@ -947,7 +4183,7 @@ int main(int argc, char** argv) {
   /* Define them with the following language */
   mpca_lang(MPCA_LANG_DEFAULT, 
 	    "																                	\
-			number		: /-?[0-9]+/													;\
+			number		: /-?[0-9]+(\\.[0-9]+)?/											;\
 			symbol		: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/                                                                              ;\
                         string          : /\"(\\\\.|[^\"])*\"/ ;                                                                                         \
                         comment          : /;[^\\r\\n]*/ ;                                                                                         \
@@ -958,8 +4194,13 @@ int main(int argc, char** argv) {
 		",
 	    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Galisp);
 
+  lsym_rest = lsym_intern("&");
+
   lenv* e = lenv_new();
+  lenv_globals = e;
   lenv_add_builtins(e);
+  gc_root_env(e);
+  gc.trace = getenv("GALISP_GC_TRACE") != NULL;
   
   if(argc >= 2) {
     for(int i = 0; i < argc; i++) {
@@ -967,7 +4208,7 @@ int main(int argc, char** argv) {
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
       lval* x = builtin_load(e, args);
 
-      if( x->type == LVAL_ERR) { lval_println(x); }
+      if( lval_type(x) == LVAL_ERR) { lval_println(x); }
 
       lval_del(x);
     }
@@ -999,6 +4240,7 @@ int main(int argc, char** argv) {
       // lval* x = lval_read(r.output);
       lval_println(x);
       lval_del(x);
+      gc_safepoint();
       mpc_ast_delete(r.output);
     } else {    
       mpc_err_print(r.error);